@@ -334,6 +334,24 @@ QMAKE_EXTRA_COMPILERS += gccsse2
 SOURCES_SSE2 += src/scrypt-sse2.cpp
 }
 
+contains(USE_AVX2, 1) {
+DEFINES += USE_AVX2
+gccavx2.input  = SOURCES_AVX2
+gccavx2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx2 -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccavx2
+SOURCES_AVX2 += src/scrypt-avx2.cpp
+}
+
+contains(USE_AVX512, 1) {
+DEFINES += USE_AVX512
+gccavx512.input  = SOURCES_AVX512
+gccavx512.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx512.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx512f -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccavx512
+SOURCES_AVX512 += src/scrypt-avx512.cpp
+}
+
 # Todo: Remove this line when switching to Qt5, as that option was removed
 CODECFORTR = UTF-8
 
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <string>
 #include <boost/thread/mutex.hpp>
+#include <boost/pool/singleton_pool.hpp>
 #include <map>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
@@ -265,6 +266,59 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+//
+// Allocator that takes single objects from a pool of same-sized blocks
+// instead of the heap. Meant for node based containers with many small,
+// short lived nodes; arrays (like hash table buckets) go to the heap.
+// Freed blocks are kept for reuse, not returned to the system.
+//
+struct pooled_allocator_tag { };
+
+template<typename T>
+struct pooled_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    typedef boost::singleton_pool<pooled_allocator_tag, sizeof(T)> pool;
+    pooled_allocator() throw() {}
+    pooled_allocator(const pooled_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pooled_allocator(const pooled_allocator<U>& a) throw() : base(a) {}
+    ~pooled_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef pooled_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        if (n != 1)
+            return std::allocator<T>::allocate(n, hint);
+        T *p = static_cast<T*>(pool::malloc());
+        if (p == NULL)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n != 1)
+            std::allocator<T>::deallocate(p, n);
+        else
+            pool::free(p);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const pooled_allocator<T>&, const pooled_allocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const pooled_allocator<T>&, const pooled_allocator<U>&) { return false; }
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -18,6 +18,7 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -26,6 +27,12 @@
 #include <ifaddrs.h>
 #endif
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 typedef u_int SOCKET;
 #ifdef WIN32
 #define MSG_NOSIGNAL        0
@@ -8,14 +8,13 @@
 
 
 #include "diffshield.h"
-#include "bignum.h"
 #include "main.h"
 
 static const int64 nTargetTimespan = 18000;
 static const int64 nTargetSpacing = 60;
 static const int64 nInterval = nTargetTimespan / nTargetSpacing;
 
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // LitecoinDark: starting difficulty is 1 / 2^12
+static const uint256 bnProofOfWorkLimit = ~uint256(0) >> 20; // LitecoinDark: starting difficulty is 1 / 2^12
 extern bool fTestNet;
 
 extern int nHeight;
@@ -49,7 +48,7 @@ namespace litecoindark
 		    if (fTestNet && time > target_spacing*2)
 		        return bnProofOfWorkLimit.GetCompact();
 
-		    CBigNum bnResult;
+		    uint256 bnResult;
 		    bnResult.SetCompact(base);
 
 		    while (time > 0 && bnResult < bnProofOfWorkLimit)
@@ -126,10 +125,10 @@ namespace litecoindark
 				actual_timespan = target_timespan * 4;
 
 			// Retarget
-			CBigNum bnNew;
+			uint256 bnNew;
 			bnNew.SetCompact(pindexLast->nBits);
-			bnNew *= actual_timespan;
-			bnNew /= target_timespan;
+			bnNew *= (uint64)actual_timespan;
+			bnNew /= (uint64)target_timespan;
 
 			if (bnNew > bnProofOfWorkLimit)
 				bnNew = bnProofOfWorkLimit;
@@ -137,8 +136,8 @@ namespace litecoindark
 			/// debug print
 			printf("DifficultyShield RETARGET\n");
 			printf("target_timespan = %"PRI64d"    actual_timespan = %"PRI64d"\n", target_timespan, actual_timespan);
-			printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-			printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+			printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+			printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
 			return bnNew.GetCompact();
 		}
@@ -212,10 +211,10 @@ namespace litecoindark
 				actual_timespan = target_timespan * 4;
 
 			// Retarget
-			CBigNum bnNew;
+			uint256 bnNew;
 			bnNew.SetCompact(pindexLast->nBits);
-			bnNew *= actual_timespan;
-			bnNew /= target_timespan;
+			bnNew *= (uint64)actual_timespan;
+			bnNew /= (uint64)target_timespan;
 
 			if (bnNew > bnProofOfWorkLimit)
 				bnNew = bnProofOfWorkLimit;
@@ -223,8 +222,8 @@ namespace litecoindark
 			/// debug print
 			printf("DifficultyShield RETARGET\n");
 			printf("target_timespan = %"PRI64d"    actual_timespan = %"PRI64d"\n", target_timespan, actual_timespan);
-			printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-			printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+			printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+			printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
 			return bnNew.GetCompact();
 		}
@@ -235,25 +234,72 @@ namespace litecoindark
 			past_blocks_min(past_blocks_minimum),
 			past_blocks_max(past_blocks_maximum)
 		{
-
+			// pow() dominated the walk, and its argument only depends on how far back we are
+			event_horizon.resize(past_blocks_max + 1);
+			for (uint64 mass = 1; mass <= past_blocks_max; mass++)
+			{
+				event_horizon[mass] = 1 + (0.7084 * pow((double(mass)/double(144)), -1.228));
+			}
 		}
 
 		kgw_difficulty_engine::~kgw_difficulty_engine(){}
 
+		double kgw_difficulty_engine::event_horizon_deviation(uint64 mass) const
+		{
+			if (mass < event_horizon.size())
+			{
+				return event_horizon[mass];
+			}
+			return 1 + (0.7084 * pow((double(mass)/double(144)), -1.228));
+		}
+
 		unsigned kgw_difficulty_engine::get_next_work_required(const CBlockIndex* pindexLast, const CBlockHeader* pblock)
+		{
+			if (pindexLast == NULL)
+			{
+				return bnProofOfWorkLimit.GetCompact();
+			}
+
+			const uint256 hash_last = pindexLast->GetBlockHash();
+			{
+				LOCK(cs_tips);
+				std::map<uint256, unsigned>::const_iterator it = tips.find(hash_last);
+				if (it != tips.end())
+				{
+					return it->second;
+				}
+			}
+
+			unsigned bits = compute_next_work_required(pindexLast);
+
+			{
+				LOCK(cs_tips);
+				if (tips.insert(std::make_pair(hash_last, bits)).second)
+				{
+					tips_order.push_back(hash_last);
+					if (tips_order.size() > max_cached_tips)
+					{
+						tips.erase(tips_order.front());
+						tips_order.pop_front();
+					}
+				}
+			}
+
+			return bits;
+		}
+
+		unsigned kgw_difficulty_engine::compute_next_work_required(const CBlockIndex* pindexLast) const
 		{
 
 			/* current difficulty formula, megacoin - kimoto gravity well */
 			const CBlockIndex  *BlockLastSolved                                = pindexLast;
 			const CBlockIndex  *BlockReading                                = pindexLast;
-			const CBlockHeader *BlockCreating                                = pblock;
-													BlockCreating                                = BlockCreating;
 			uint64                                PastBlocksMass                                = 0;
 			int64                                PastRateActualSeconds                = 0;
 			int64                                PastRateTargetSeconds                = 0;
 			double                                PastRateAdjustmentRatio                = double(1);
-			CBigNum                                PastDifficultyAverage;
-			CBigNum                                PastDifficultyAveragePrev;
+			uint256                                PastDifficultyAverage;
+			uint256                                PastDifficultyAveragePrev;
 			double                                EventHorizonDeviation;
 			double                                EventHorizonDeviationFast;
 			double                                EventHorizonDeviationSlow;
@@ -278,7 +324,22 @@ namespace litecoindark
 				}
 				else
 				{
-					PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev;
+					// Same as the signed ((Reading - Prev) / i) + Prev, the quotient truncating towards zero
+					uint256 PastDifficultyReading;
+					PastDifficultyReading.SetCompact(BlockReading->nBits);
+					if (PastDifficultyReading >= PastDifficultyAveragePrev)
+					{
+						PastDifficultyReading -= PastDifficultyAveragePrev;
+						PastDifficultyReading /= (uint64)i;
+						PastDifficultyAverage += PastDifficultyReading;
+					}
+					else
+					{
+						uint256 PastDifficultyDelta = PastDifficultyAveragePrev;
+						PastDifficultyDelta -= PastDifficultyReading;
+						PastDifficultyDelta /= (uint64)i;
+						PastDifficultyAverage -= PastDifficultyDelta;
+					}
 				}
 
 				PastDifficultyAveragePrev = PastDifficultyAverage;
@@ -297,7 +358,7 @@ namespace litecoindark
 					PastRateAdjustmentRatio                        = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
 				}
 
-				EventHorizonDeviation     = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+				EventHorizonDeviation     = event_horizon_deviation(PastBlocksMass);
 				EventHorizonDeviationFast = EventHorizonDeviation;
 				EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
 
@@ -318,12 +379,20 @@ namespace litecoindark
 				BlockReading = BlockReading->pprev;
 			}
 
-			CBigNum bnNew(PastDifficultyAverage);
+			uint256 bnNew(PastDifficultyAverage);
 
 			if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0)
 			{
-					bnNew *= PastRateActualSeconds;
-					bnNew /= PastRateTargetSeconds;
+				if (bnNew > ~uint256(0) / (uint64)PastRateActualSeconds)
+				{
+					// The product does not fit in 256 bits, so the quotient is way above the limit
+					bnNew = bnProofOfWorkLimit;
+				}
+				else
+				{
+					bnNew *= (uint64)PastRateActualSeconds;
+					bnNew /= (uint64)PastRateTargetSeconds;
+				}
 			}
 
 		    if (bnNew > bnProofOfWorkLimit)
@@ -334,8 +403,8 @@ namespace litecoindark
 		    /// debug print
 		    printf("Difficulty Retarget - Kimoto Gravity Well\n");
 		    printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-		    printf("Before: %08x  %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
-		    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+		    printf("Before: %08x  %s\n", BlockLastSolved->nBits, uint256().SetCompact(BlockLastSolved->nBits).ToString().c_str());
+		    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
 		    return bnNew.GetCompact();
 		}
@@ -12,6 +12,11 @@
 #define DIFFSHIELD_H_
 
 #include "uint256.h"
+#include "sync.h"
+
+#include <deque>
+#include <map>
+#include <vector>
 
 class CBlockIndex;
 class CBlockHeader;
@@ -76,16 +81,40 @@ namespace litecoindark
 			virtual unsigned get_next_work_required(const CBlockIndex* last_index, const CBlockHeader* block);
 		};
 
+		/** Kimoto Gravity Well.
+		 *
+		 *  The result only depends on the chain ending in last_index, never on the
+		 *  block being built, so it is remembered per tip: repeated calls for the
+		 *  same parent (CreateNewBlock, getwork polling, AcceptBlock of a block we
+		 *  mined or already templated) are answered without walking the chain.
+		 *  A new tip or a reorg falls back to compute_next_work_required().
+		 */
 		class kgw_difficulty_engine : public difficulty_engine
 		{
 			uint64 past_blocks_min;
 			uint64 past_blocks_max;
 
+			// EventHorizonDeviation for every PastBlocksMass up to past_blocks_max
+			std::vector<double> event_horizon;
+
+			// Results of compute_next_work_required() keyed by the hash of last_index
+			CCriticalSection cs_tips;
+			std::map<uint256, unsigned> tips;
+			std::deque<uint256> tips_order;
+
+			double event_horizon_deviation(uint64 mass) const;
+
 		public:
+			// Number of tips whose next work is remembered
+			static const unsigned int max_cached_tips = 64;
+
 			kgw_difficulty_engine(int64 spacing, uint64 past_blocks_minimum, uint64 past_blocks_maximum);
 			virtual ~kgw_difficulty_engine();
 
 			virtual unsigned get_next_work_required(const CBlockIndex* last_index, const CBlockHeader* block);
+
+			// Full walk back over the past blocks, bypassing the tip cache
+			unsigned compute_next_work_required(const CBlockIndex* last_index) const;
 		};
 	}
 }
@@ -79,13 +79,17 @@ volatile bool fRequestShutdown = false;
 void StartShutdown()
 {
     fRequestShutdown = true;
+    {
+        // Release getblocktemplate long polls
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
 }
 bool ShutdownRequested()
 {
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
 
 void Shutdown()
 {
@@ -102,12 +106,15 @@ void Shutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
+    FlushWalletNotifications();
     {
         LOCK(cs_main);
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-        if (pblocktree)
+        if (pblocktree) {
+            SyncBlockData();
             pblocktree->Flush();
+        }
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
@@ -302,6 +309,8 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -syncinterval=<n>      " + _("Batch block, undo and chainstate writes, syncing them to disk at most every <n> seconds (default: 0, sync every block)") + "\n" +
+        "  -syncbytes=<n>         " + _("With -syncinterval, also sync after <n> megabytes of block and undo data (default: 64)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -309,6 +318,9 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 11040 or testnet: 5744)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+#ifdef USE_EPOLL
+        "  -epoll                 " + _("Use epoll instead of select for network sockets (default: 1)") + "\n" +
+#endif
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -324,6 +336,7 @@ std::string HelpMessage()
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
+        "  -compactblocks         " + _("Ask peers for new blocks as short transaction ids, filled in from the memory pool (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -368,9 +381,12 @@ std::string HelpMessage()
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
+        "  -loadtxoutset=<file>   " + _("Replace the UTXO set with a snapshot written by dumptxoutset, if the chain is behind it") + "\n" +
         "  -maxorphantx=<n>       " + _("Keep at most <n> unconnectable transactions in memory (default: 25)") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -msghandlers=<n>       " + _("Set the number of network message handler threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Set the valid signature cache size in megabytes (default: 4, 0 = off)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -406,18 +422,20 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
+        int nFiles = 0;
         while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            FILE *file = OpenBlockFile(pos, true);
+            FILE *file = OpenBlockFile(CDiskBlockPos(nFiles, 0), true);
             if (!file)
                 break;
-            printf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+            fclose(file);
+            nFiles++;
         }
+        printf("Reindexing %d block files...\n", nFiles);
+        ReindexBlockFiles(nFiles);
         pblocktree->WriteReindexing(false);
         fReindex = false;
+        std::vector<uint256> vNone;
+        SetReindexProofOfWork(vNone);
         printf("Reindexing finished\n");
         // To avoid ending up in a situation without genesis block, re-try initializing (no-op if reindexing worked):
         InitBlockIndex();
@@ -431,20 +449,24 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             CImportingNow imp;
             filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
             printf("Importing bootstrap.dat...\n");
-            LoadExternalBlockFile(file);
+            LoadExternalBlockFiles(std::vector<FILE*>(1, file));
             RenameOver(pathBootstrap, pathBootstrapOld);
         }
     }
 
     // -loadblock=
+    std::vector<FILE*> vFiles;
     BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
         FILE *file = fopen(path.string().c_str(), "rb");
         if (file) {
-            CImportingNow imp;
             printf("Importing %s...\n", path.string().c_str());
-            LoadExternalBlockFile(file);
+            vFiles.push_back(file);
         }
     }
+    if (!vFiles.empty()) {
+        CImportingNow imp;
+        LoadExternalBlockFiles(vFiles);
+    }
 }
 
 /** Initialize bitcoin.
@@ -506,6 +528,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fTestNet = GetBoolArg("-testnet");
     fBloomFilters = GetBoolArg("-bloomfilters", true);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
 
@@ -545,7 +568,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() watches at most FD_SETSIZE sockets, epoll only needs the descriptors
+    if (!InitSocketEvents())
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -665,16 +690,21 @@ bool AppInit2(boost::thread_group& threadGroup)
         fprintf(stdout, "LitecoinDark server starting\n");
 
     if (nScriptCheckThreads) {
-        printf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        printf("Using %u threads for script verification and block pre-checks\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadBlockPreCheck);
+        }
     }
 
+    threadGroup.create_thread(&ThreadWalletNotify);
+
     int64 nStart;
 
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    scrypt_detect_multi();
 
     // ********************************************************* Step 5: verify wallet database integrity
 
@@ -863,7 +893,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest bounds the in-memory coins cache
+
+    nSyncInterval = GetArg("-syncinterval", 0);
+    if (nSyncInterval < 0)
+        nSyncInterval = 0;
+    nSyncBytes = (uint64)std::max(GetArg("-syncbytes", DEFAULT_SYNC_BYTES), (int64)1) << 20;
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -880,6 +915,20 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsdbview;
                 delete pblocktree;
 
+                if (fReindex) {
+                    // Remember which headers the old block tree already verified,
+                    // so reindexing does not have to recompute their scrypt hashes
+                    std::vector<uint256> vHash;
+                    try {
+                        CBlockTreeDB blocktreeOld(nBlockTreeDBCache);
+                        blocktreeOld.ReadVerifiedProofOfWork(vHash);
+                    } catch(std::exception &e) {
+                        printf("Could not read proof-of-work results from old block index: %s\n", e.what());
+                    }
+                    printf("Reindexing will skip proof-of-work checks for %"PRIszu" known headers\n", vHash.size());
+                    SetReindexProofOfWork(vHash);
+                }
+
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
@@ -892,6 +941,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Blocks written after the last batched sync may be missing after a crash
+                if (!fReindex && !CheckUnsyncedBlockData()) {
+                    strLoadError = _("Corrupted block database detected");
+                    break;
+                }
+
                 // If the loaded chain has a wrong genesis, bail out immediately
                 // (we're likely using a testnet datadir, or the other way around).
                 if (!mapBlockIndex.empty() && pindexGenesisBlock == NULL)
@@ -903,6 +958,20 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Start from a UTXO snapshot, then reload so the chain continues from its block
+                if (mapArgs.count("-loadtxoutset") && !fReindex) {
+                    uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                    if (!LoadTxOutSet(GetDataDir() / mapArgs["-loadtxoutset"]))
+                        return InitError(_("Error loading UTXO snapshot"));
+                    UnloadBlockIndex();
+                    delete pcoinsTip;
+                    pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                    if (!LoadBlockIndex()) {
+                        strLoadError = _("Error loading block database");
+                        break;
+                    }
+                }
+
                 // Check for changed -txindex state
                 if (fTxIndex != GetBoolArg("-txindex", false)) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
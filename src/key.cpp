@@ -6,6 +6,11 @@
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
+#include <deque>
+#include <map>
+
+#include <boost/thread/tss.hpp>
+
 #include "key.h"
 
 
@@ -256,6 +261,59 @@ public:
     }
 };
 
+// Public keys recently verified against by this thread, already decoded.
+// A fresh CECKey builds the secp256k1 group, and decoding a compressed key
+// takes a modular square root; with addresses reused across transactions
+// the same keys keep coming back while connecting blocks. Each thread has
+// its own cache because OpenSSL 1.0 attaches method data to an EC_KEY the
+// first time it verifies, so the keys can't be shared without locking.
+class CParsedPubKeyCache {
+private:
+    std::map<CPubKey, CECKey*> mapKeys;
+    std::deque<CPubKey> queueKeys; // insertion order, for eviction
+
+public:
+    static const unsigned int MAX_SIZE = 1024;
+
+    ~CParsedPubKeyCache() {
+        for (std::map<CPubKey, CECKey*>::iterator it = mapKeys.begin(); it != mapKeys.end(); it++)
+            delete it->second;
+    }
+
+    // Returns NULL if pubkey does not decode to a point on the curve
+    CECKey *Get(const CPubKey &pubkey) {
+        std::map<CPubKey, CECKey*>::iterator it = mapKeys.find(pubkey);
+        if (it != mapKeys.end())
+            return it->second;
+
+        CECKey *pkey = new CECKey();
+        if (!pkey->SetPubKey(pubkey)) {
+            delete pkey;
+            return NULL;
+        }
+        if (queueKeys.size() >= MAX_SIZE) {
+            it = mapKeys.find(queueKeys.front());
+            delete it->second;
+            mapKeys.erase(it);
+            queueKeys.pop_front();
+        }
+        mapKeys.insert(std::make_pair(pubkey, pkey));
+        queueKeys.push_back(pubkey);
+        return pkey;
+    }
+};
+
+boost::thread_specific_ptr<CParsedPubKeyCache> parsedPubKeyCache;
+
+CECKey *GetParsedPubKey(const CPubKey &pubkey) {
+    CParsedPubKeyCache *pcache = parsedPubKeyCache.get();
+    if (!pcache) {
+        pcache = new CParsedPubKeyCache();
+        parsedPubKeyCache.reset(pcache);
+    }
+    return pcache->Get(pubkey);
+}
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -343,10 +401,10 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
+    CECKey *pkey = GetParsedPubKey(*this);
+    if (!pkey)
         return false;
-    if (!key.Verify(hash, vchSig))
+    if (!pkey->Verify(hash, vchSig))
         return false;
     return true;
 }
@@ -50,6 +50,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDB
@@ -148,6 +152,25 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // A consistent view of the database as it is now, for long reads that
+    // should not hold up writers. Release it with ReleaseSnapshot.
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *snapshot) {
+        pdb->ReleaseSnapshot(snapshot);
+    }
+
+    // Iterate over a snapshot, without filling the block cache with values
+    // that are only read once
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *snapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        options.fill_cache = false;
+        return pdb->NewIterator(options);
+    }
 };
 
 #endif // BITCOIN_LEVELDB_H
@@ -15,6 +15,8 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include <memory>
 
@@ -37,17 +39,21 @@ set<CWallet*> setpwalletRegistered;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CConnectTimings connecttimings(CONNECT_TIMINGS_WINDOW);
 unsigned int nTransactionsUpdated = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock("0x0e286802e2a399cad2f4a6e41f0584a162dddfb303b78839b690e77dee2310e1");
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // LitecoinDark: starting difficulty is 1 / 2^12
+static const uint256 bnProofOfWorkLimit = ~uint256(0) >> 20; // LitecoinDark: starting difficulty is 1 / 2^12
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
 CBlockIndex* pindexBest = NULL;
+vector<CBlockIndex*> vBlockIndexByHeight; // active chain, indexed by height
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
@@ -55,7 +61,10 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+int64 nSyncInterval = 0;
+uint64 nSyncBytes = (uint64)DEFAULT_SYNC_BYTES << 20;
+bool fCompactBlocks = true;
 
 
 // LitecoinDark DifficultyShield
@@ -128,6 +137,8 @@ void RegisterWallet(CWallet* pwalletIn)
 
 void UnregisterWallet(CWallet* pwalletIn)
 {
+    // Let it see everything queued for it first
+    FlushWalletNotifications();
     {
         LOCK(cs_setpwalletRegistered);
         setpwalletRegistered.erase(pwalletIn);
@@ -143,34 +154,193 @@ bool static GetTransaction(const uint256& hashTx, CWalletTx& wtx)
     return false;
 }
 
+// Notifications for the wallets from validation, run in order by
+// ThreadWalletNotify so that wallet lookups and writes happen outside
+// cs_main. Without that thread (unit tests, shutdown) they run right away.
+class CWalletNotifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condQueued; // notifications were queued
+    boost::condition_variable condDone;   // a notification was taken or finished
+    std::deque<boost::function<void()> > queue;
+    unsigned int nBlocks;                 // connected blocks in queue
+    bool fRunning;                        // the thread is running a notification
+    bool fThread;                         // the thread is there
+
+    void RunQueued(boost::unique_lock<boost::mutex> &lock) {
+        while (!queue.empty()) {
+            boost::function<void()> func = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            Run(func);
+            lock.lock();
+        }
+    }
+
+    static void Run(const boost::function<void()> &func) {
+        try {
+            func();
+        } catch (std::exception &e) {
+            PrintExceptionContinue(&e, "CWalletNotifyQueue::Run()");
+        }
+    }
+
+public:
+    CWalletNotifyQueue() : nBlocks(0), fRunning(false), fThread(false) {}
+
+    // Connected blocks are waited for once MAX_WALLET_NOTIFY_BLOCKS are
+    // queued. Others never wait, as they may come from a thread that holds
+    // cs_wallet, which the notification thread needs.
+    void Push(const boost::function<void()> &func, bool fBlock) {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fBlock && fThread && nBlocks >= MAX_WALLET_NOTIFY_BLOCKS)
+            condDone.wait(lock);
+        if (fThread) {
+            if (fBlock) {
+                queue.push_back(boost::bind(&CWalletNotifyQueue::RunBlock, this, func));
+                nBlocks++;
+            } else
+                queue.push_back(func);
+            condQueued.notify_one();
+            return;
+        }
+        RunQueued(lock);
+        lock.unlock();
+        Run(func);
+    }
+
+    void RunBlock(const boost::function<void()> &func) {
+        Run(func);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nBlocks--;
+        condDone.notify_all();
+    }
+
+    void Flush() {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fThread) {
+            RunQueued(lock);
+            return;
+        }
+        while (!queue.empty() || fRunning)
+            condDone.wait(lock);
+    }
+
+    void Thread() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fThread = true;
+        try {
+            while (true) {
+                fRunning = false;
+                condDone.notify_all();
+                while (queue.empty())
+                    condQueued.wait(lock);
+                boost::function<void()> func = queue.front();
+                queue.pop_front();
+                fRunning = true;
+                lock.unlock();
+                {
+                    boost::this_thread::disable_interruption di;
+                    Run(func);
+                }
+                lock.lock();
+            }
+        } catch (boost::thread_interrupted) {
+            // What is left runs on whichever thread pushes or flushes next
+            fThread = false;
+            fRunning = false;
+            condDone.notify_all();
+            throw;
+        }
+    }
+};
+
+static CWalletNotifyQueue walletnotifyqueue;
+
+void ThreadWalletNotify()
+{
+    RenameThread("bitcoin-walletnt");
+    walletnotifyqueue.Thread();
+}
+
+void FlushWalletNotifications()
+{
+    walletnotifyqueue.Flush();
+}
+
 // erases transaction with the given hash from all wallets
-void static EraseFromWallets(uint256 hash)
+void static EraseFromWalletsNow(uint256 hash)
 {
+    LOCK(cs_setpwalletRegistered);
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         pwallet->EraseFromWallet(hash);
 }
 
+void static EraseFromWallets(uint256 hash)
+{
+    walletnotifyqueue.Push(boost::bind(&EraseFromWalletsNow, hash), false);
+}
+
 // make sure all wallets know about the given transaction, in the given block
+void static SyncWithWalletsNow(const uint256 &hash, const CTransaction& tx, const boost::shared_ptr<const CBlock> &pblock, bool fUpdate)
+{
+    LOCK(cs_setpwalletRegistered);
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->AddToWalletIfInvolvingMe(hash, tx, pblock.get(), fUpdate);
+}
+
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate)
 {
+    boost::shared_ptr<const CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    walletnotifyqueue.Push(boost::bind(&SyncWithWalletsNow, hash, tx, pblockCopy, fUpdate), false);
+}
+
+// make sure all wallets know about the transactions of a connected block
+void static SyncBlockWithWalletsNow(const boost::shared_ptr<const CBlock> &pblock)
+{
+    LOCK(cs_setpwalletRegistered);
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate);
+        for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+            pwallet->AddToWalletIfInvolvingMe(pblock->GetTxHash(i), pblock->vtx[i], pblock.get(), true);
+}
+
+void SyncWithWallets(const CBlock& block)
+{
+    boost::shared_ptr<const CBlock> pblock(new CBlock(block));
+    walletnotifyqueue.Push(boost::bind(&SyncBlockWithWalletsNow, pblock), true);
 }
 
 // notify wallets about a new best chain
-void static SetBestChain(const CBlockLocator& loc)
+void static SetBestChainNow(const CBlockLocator& loc)
 {
+    LOCK(cs_setpwalletRegistered);
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         pwallet->SetBestChain(loc);
 }
 
+void static SetBestChain(const CBlockLocator& loc)
+{
+    walletnotifyqueue.Push(boost::bind(&SetBestChainNow, loc), false);
+}
+
 // notify wallets about an updated transaction
-void static UpdatedTransaction(const uint256& hashTx)
+void static UpdatedTransactionNow(const uint256& hashTx)
 {
+    LOCK(cs_setpwalletRegistered);
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         pwallet->UpdatedTransaction(hashTx);
 }
 
+void static UpdatedTransaction(const uint256& hashTx)
+{
+    walletnotifyqueue.Push(boost::bind(&UpdatedTransactionNow, hashTx), false);
+}
+
 // dump all wallets
 void static PrintWallets(const CBlock& block)
 {
@@ -181,6 +351,7 @@ void static PrintWallets(const CBlock& block)
 // notify wallets about an incoming inventory (for request counts)
 void static Inventory(const uint256& hash)
 {
+    LOCK(cs_setpwalletRegistered);
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         pwallet->Inventory(hash);
 }
@@ -208,7 +379,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -219,43 +390,92 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    uint256 salt = GetRandHash();
+    k0 = salt.Get64(0);
+    k1 = salt.Get64(1);
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), nCachedCoinsUsage(0), fHasModifier(false) { }
+
+CCoinsViewCache::~CCoinsViewCache() {
+    assert(!fHasModifier);
+}
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it != cacheCoins.end()) {
+        coins = it->second.coins;
         return true;
     }
     return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    if (ret->second.coins.IsPruned()) {
+        // The base only has a spent version, which we need not write back
+        ret->second.nFlags = CCoinsCacheEntry::FRESH;
+    }
+    nCachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
-CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+const CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->second.coins;
+}
+
+CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
+    assert(!fHasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t nUsageBefore = 0;
+    CCoinsCacheEntry &entry = ret.first->second;
+    if (ret.second) {
+        // Not cached yet: the base tells whether it has an unspent version
+        if (!base->GetCoins(txid, entry.coins) || entry.coins.IsPruned()) {
+            entry.coins = CCoins();
+            entry.nFlags = CCoinsCacheEntry::FRESH;
+        }
+    } else {
+        nUsageBefore = entry.coins.DynamicMemoryUsage();
+    }
+    entry.nFlags |= CCoinsCacheEntry::DIRTY;
+    return CCoinsModifier(*this, ret.first, nUsageBefore);
+}
+
+CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid) {
+    assert(!fHasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t nUsageBefore = 0;
+    CCoinsCacheEntry &entry = ret.first->second;
+    if (ret.second) {
+        entry.nFlags = CCoinsCacheEntry::FRESH;
+    } else {
+        // A cached entry can only be a spent one here. If this cache spent
+        // it, the base may still hold it unspent and has to be told.
+        nUsageBefore = entry.coins.DynamicMemoryUsage();
+        if (!(entry.nFlags & CCoinsCacheEntry::DIRTY))
+            entry.nFlags |= CCoinsCacheEntry::FRESH;
+    }
+    entry.nFlags |= CCoinsCacheEntry::DIRTY;
+    return CCoinsModifier(*this, ret.first, nUsageBefore);
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    CCoinsModifier modifier = ModifyCoins(txid);
+    *modifier = coins;
     return true;
 }
 
@@ -274,17 +494,41 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    assert(!fHasModifier);
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+        // Entries the child did not change are still the same here
+        if (!(it->second.nFlags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // Created and spent again below us, without our base ever seeing it
+            if ((it->second.nFlags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins[it->first];
+            entry.coins.swap(it->second.coins);
+            nCachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+            entry.nFlags = CCoinsCacheEntry::DIRTY | (it->second.nFlags & CCoinsCacheEntry::FRESH);
+        } else if ((itUs->second.nFlags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+            // Our base never had it unspent, so just forget it
+            nCachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(itUs);
+        } else {
+            nCachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+            itUs->second.coins.swap(it->second.coins);
+            nCachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+            itUs->second.nFlags |= CCoinsCacheEntry::DIRTY;
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    assert(!fHasModifier);
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
-        cacheCoins.clear();
+    cacheCoins.clear();
+    nCachedCoinsUsage = 0;
     return fOk;
 }
 
@@ -292,6 +536,31 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    // Nodes come from a pool, so only the hash table's bucket array pays
+    // malloc overhead. A node holds the key, the entry and a next pointer.
+    return cacheCoins.size() * (sizeof(CCoinsMap::value_type) + sizeof(void*)) +
+           MallocUsage(cacheCoins.bucket_count() * sizeof(void*)) +
+           nCachedCoinsUsage;
+}
+
+CCoinsModifier::CCoinsModifier(CCoinsViewCache &cacheIn, CCoinsMap::iterator itIn, size_t nUsageBeforeIn) :
+    cache(cacheIn), it(itIn), nUsageBefore(nUsageBeforeIn) {
+    assert(!cache.fHasModifier);
+    cache.fHasModifier = true;
+}
+
+CCoinsModifier::~CCoinsModifier() {
+    assert(cache.fHasModifier);
+    cache.fHasModifier = false;
+    it->second.coins.Cleanup();
+    cache.nCachedCoinsUsage -= nUsageBefore;
+    if ((it->second.nFlags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+        cache.cacheCoins.erase(it);
+    else
+        cache.nCachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -311,6 +580,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -532,6 +802,28 @@ unsigned int CTransaction::GetLegacySigOpCount() const
 }
 
 
+bool CMerkleTx::SetMerkleBranchFromBlock(const CBlock& block)
+{
+    // Update the tx's hashBlock
+    hashBlock = block.GetHash();
+
+    // Locate the transaction
+    for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
+        if (block.vtx[nIndex] == *(CTransaction*)this)
+            break;
+    if (nIndex == (int)block.vtx.size())
+    {
+        vMerkleBranch.clear();
+        nIndex = -1;
+        printf("ERROR: SetMerkleBranch() : couldn't find tx in block\n");
+        return false;
+    }
+
+    // Fill in merkle branch
+    vMerkleBranch = block.GetMerkleBranch(nIndex);
+    return true;
+}
+
 int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 {
     CBlock blockTmp;
@@ -548,25 +840,8 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
         }
     }
 
-    if (pblock) {
-        // Update the tx's hashBlock
-        hashBlock = pblock->GetHash();
-
-        // Locate the transaction
-        for (nIndex = 0; nIndex < (int)pblock->vtx.size(); nIndex++)
-            if (pblock->vtx[nIndex] == *(CTransaction*)this)
-                break;
-        if (nIndex == (int)pblock->vtx.size())
-        {
-            vMerkleBranch.clear();
-            nIndex = -1;
-            printf("ERROR: SetMerkleBranch() : couldn't find tx in block\n");
-            return 0;
-        }
-
-        // Fill in merkle branch
-        vMerkleBranch = pblock->GetMerkleBranch(nIndex);
-    }
+    if (pblock && !SetMerkleBranchFromBlock(*pblock))
+        return 0;
 
     // Is the tx in a block that's in the main chain
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
@@ -873,11 +1148,122 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        CTxMemPoolEntry &entry = mapEntry[hash];
+        entry.ptx = &mapTx[hash];
+        entry.hash = hash;
+        markStale(hash);
+        markChildrenStale(hash);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::unindexEntry(CTxMemPoolEntry &entry)
+{
+    if (entry.fIndexed) {
+        setByPriority.erase(&entry);
+        setByFeeRate.erase(&entry);
+        entry.fIndexed = false;
+    }
+}
+
+void CTxMemPool::markStale(const uint256& hash)
+{
+    std::map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    if (it != mapEntry.end()) {
+        unindexEntry(it->second);
+        setStale.insert(hash);
+    }
+}
+
+// Transactions spending outputs of hash have to look their inputs up again
+// when it enters or leaves the memory pool.
+void CTxMemPool::markChildrenStale(const uint256& hash)
+{
+    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+    for (; it != mapNextTx.end() && it->first.hash == hash; it++)
+        markStale(it->second.ptx->GetHash());
+}
+
+void CTxMemPool::updateIndexes(int nHeight, CCoinsViewCache &view)
+{
+    LOCK(cs);
+
+    BOOST_FOREACH(const uint256& hash, setStale) {
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+        if (mi == mapEntry.end())
+            continue;
+        CTxMemPoolEntry &entry = mi->second;
+        const CTransaction &tx = *entry.ptx;
+        if (tx.IsCoinBase())
+            continue;
+
+        entry.setMemPoolParents.clear();
+        entry.dChainValueIn = entry.dChainValueHeight = 0;
+        int64 nTotalIn = 0;
+        bool fMissingInputs = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Read prev transaction
+            if (!view.HaveCoins(txin.prevout.hash))
+            {
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                std::map<uint256, CTransaction>::iterator mit = mapTx.find(txin.prevout.hash);
+                if (mit == mapTx.end())
+                {
+                    printf("ERROR: mempool transaction missing input\n");
+                    if (fDebug) assert("mempool transaction missing input" == 0);
+                    fMissingInputs = true;
+                    break;
+                }
+
+                // Has to wait for dependencies
+                entry.setMemPoolParents.insert(txin.prevout.hash);
+                nTotalIn += mit->second.vout[txin.prevout.n].nValue;
+                continue;
+            }
+            const CCoins &coins = view.GetCoins(txin.prevout.hash);
+
+            int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+            nTotalIn += nValueIn;
+            entry.dChainValueIn += nValueIn;
+            entry.dChainValueHeight += (double)nValueIn * coins.nHeight;
+        }
+        if (fMissingInputs)
+            continue;
+
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.dPriority = entry.GetPriority(nHeight);
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        entry.dFeePerKb = double(nTotalIn-tx.GetValueOut()) / (double(entry.nTxSize)/1000.0);
+
+        setByPriority.insert(&entry);
+        setByFeeRate.insert(&entry);
+        entry.fIndexed = true;
+    }
+    setStale.clear();
+
+    // Priority grows with every block, at a different pace for every
+    // transaction, so both indexes (fee rate ties are broken by priority)
+    // have to be sorted again
+    if (nHeight != nPriorityHeight) {
+        std::vector<const CTxMemPoolEntry*> vEntries(setByFeeRate.begin(), setByFeeRate.end());
+        setByPriority.clear();
+        setByFeeRate.clear();
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vEntries) {
+            const_cast<CTxMemPoolEntry*>(pentry)->dPriority = pentry->GetPriority(nHeight);
+            setByPriority.insert(pentry);
+            setByFeeRate.insert(setByFeeRate.end(), pentry);
+        }
+        nPriorityHeight = nHeight;
+    }
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -896,6 +1282,10 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            markStale(hash);
+            mapEntry.erase(hash);
+            setStale.erase(hash);
+            markChildrenStale(hash);
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -923,6 +1313,10 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setStale.clear();
+    setByPriority.clear();
+    setByFeeRate.clear();
     ++nTransactionsUpdated;
 }
 
@@ -1027,14 +1421,28 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception &e) {
-                    return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+                boost::shared_ptr<const CBlockFileMapping> mapping;
+                const char *pchBlock;
+                unsigned int nBlockSize;
+                if (GetMappedBlock(postx, mapping, pchBlock, nBlockSize)) {
+                    CMemoryReader reader(pchBlock, pchBlock + nBlockSize, SER_DISK, CLIENT_VERSION);
+                    try {
+                        reader >> header;
+                        reader.ignore(postx.nTxOffset);
+                        reader >> txOut;
+                    } catch (std::exception &e) {
+                        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+                    }
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    try {
+                        file >> header;
+                        fseek(file, postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    } catch (std::exception &e) {
+                        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+                    }
                 }
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
@@ -1082,22 +1490,24 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
+// Rebuild vBlockIndexByHeight so that it describes the chain ending in pindexNew,
+// only touching the entries above the fork point.
+static void SetBlockIndexByHeight(CBlockIndex *pindexNew)
+{
+    if (pindexNew == NULL) {
+        vBlockIndexByHeight.clear();
+        return;
+    }
+    vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex *pindex = pindexNew; pindex != NULL && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1165,20 +1575,140 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
 }
 
+// Headers whose scrypt hash was checked recently. Blocks that made it into
+// the block index carry BLOCK_VALID_POW instead; this covers everything seen
+// before (or without) getting there, plus the old block tree while reindexing.
+static CCriticalSection cs_PoWVerified;
+static mruset<uint256> setPoWVerified(MAX_POW_CACHE_SIZE);
+static vector<uint256> vPoWVerifiedReindex; // sorted
+
+bool CheckBlockProofOfWork(const CBlockHeader& block)
+{
+    uint256 hash = block.GetHash();
+    {
+        LOCK(cs_PoWVerified);
+        if (setPoWVerified.count(hash) || binary_search(vPoWVerifiedReindex.begin(), vPoWVerifiedReindex.end(), hash))
+            return true;
+    }
+
+    if (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        return false;
+
+    LOCK(cs_PoWVerified);
+    setPoWVerified.insert(hash);
+    return true;
+}
+
+void SetReindexProofOfWork(std::vector<uint256>& vHash)
+{
+    sort(vHash.begin(), vHash.end());
+    LOCK(cs_PoWVerified);
+    vPoWVerifiedReindex.swap(vHash);
+    vHash.clear();
+}
+
+/** Pre-validation work that does not depend on the chain: the scrypt proof of
+ *  work of a group of headers, hashed side by side with the multi-way kernel,
+ *  or the merkle tree of one block. Results are recorded in the proof-of-work
+ *  cache and in the block, where CheckBlock picks them up; failures are left
+ *  for CheckBlock to report.
+ */
+class CBlockPreCheck
+{
+private:
+    std::vector<CBlockHeader> vHeaders;
+    const CBlock *pblock;
+
+public:
+    CBlockPreCheck() : pblock(NULL) {}
+    CBlockPreCheck(std::vector<CBlockHeader>::const_iterator first, std::vector<CBlockHeader>::const_iterator last) :
+        vHeaders(first, last), pblock(NULL) {}
+    CBlockPreCheck(const CBlock *pblockIn) : pblock(pblockIn) {}
+
+    bool operator()() {
+        if (!vHeaders.empty()) {
+            std::vector<char> vData(vHeaders.size() * 80);
+            std::vector<uint256> vPoWHash(vHeaders.size());
+            std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+            for (unsigned int i = 0; i < vHeaders.size(); i++)
+                memcpy(&vData[i * 80], BEGIN(vHeaders[i].nVersion), 80);
+            scrypt_1024_1_1_256_multi(&vData[0], BEGIN(vPoWHash[0]), vHeaders.size(), &vScratchpad[0]);
+            for (unsigned int i = 0; i < vHeaders.size(); i++) {
+                if (CheckProofOfWork(vPoWHash[i], vHeaders[i].nBits)) {
+                    LOCK(cs_PoWVerified);
+                    setPoWVerified.insert(vHeaders[i].GetHash());
+                }
+            }
+        }
+        if (pblock) {
+            pblock->BuildMerkleTree();
+            pblock->fPreChecked = true;
+        }
+        return true;
+    }
+
+    void swap(CBlockPreCheck &check) {
+        vHeaders.swap(check.vHeaders);
+        std::swap(pblock, check.pblock);
+    }
+};
+
+static CCheckQueue<CBlockPreCheck> blockprecheckqueue(4);
+static CCriticalSection cs_blockprecheckqueue; // one master at a time
+
+void ThreadBlockPreCheck() {
+    RenameThread("bitcoin-precheck");
+    blockprecheckqueue.Thread();
+}
+
+void PreCheckBlocks(const std::vector<CBlockHeader>& vHeaders, const std::vector<const CBlock*>& vpblock)
+{
+    std::vector<CBlockHeader> vTodo;
+    {
+        LOCK(cs_PoWVerified);
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders) {
+            uint256 hash = header.GetHash();
+            if (!setPoWVerified.count(hash) && !binary_search(vPoWVerifiedReindex.begin(), vPoWVerifiedReindex.end(), hash))
+                vTodo.push_back(header);
+        }
+    }
+
+    // Fill the SIMD lanes, unless that would leave threads without work
+    unsigned int nGroup = std::min((unsigned int)scrypt_multi_way(), (unsigned int)vTodo.size() / std::max(nScriptCheckThreads, 1));
+    nGroup = std::max(nGroup, 1U);
+    std::vector<CBlockPreCheck> vChecks;
+    for (unsigned int i = 0; i < vTodo.size(); i += nGroup)
+        vChecks.push_back(CBlockPreCheck(vTodo.begin() + i, vTodo.begin() + std::min(i + nGroup, (unsigned int)vTodo.size())));
+    BOOST_FOREACH(const CBlock* pblock, vpblock)
+        vChecks.push_back(CBlockPreCheck(pblock));
+
+    if (!nScriptCheckThreads) {
+        BOOST_FOREACH(CBlockPreCheck& check, vChecks)
+            check();
+        return;
+    }
+    LOCK(cs_blockprecheckqueue);
+    CCheckQueueControl<CBlockPreCheck> control(&blockprecheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 // Return maximum amount of blocks that other nodes claim to have
 int GetNumBlocksOfPeers()
 {
@@ -1215,7 +1745,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1341,16 +1871,17 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
     // mark inputs spent
     if (!IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
             CTxInUndo undo;
-            ret = coins.Spend(txin.prevout, undo);
+            ret = coins->Spend(txin.prevout, undo);
             assert(ret);
             txundo.vprevout.push_back(undo);
         }
     }
 
     // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    CCoins coinsNew(*this, nHeight);
+    inputs.ModifyNewCoins(txhash)->swap(coinsNew);
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1469,6 +2000,61 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
+// Blocks accepted or connected lately, most recently used first, with their
+// undo data once connected. Short reorgs find what they disconnect and
+// reconnect here instead of in the block and undo files. (protected by cs_main)
+struct CRecentBlock
+{
+    CBlock block;
+    CBlockUndo undo;
+    bool fConnected; // undo is set, and the block was connected with its scripts checked
+
+    CRecentBlock() : fConnected(false) {}
+};
+
+typedef std::list<std::pair<uint256, CRecentBlock> > RecentBlockList;
+static RecentBlockList listRecentBlocks;
+static std::map<uint256, RecentBlockList::iterator> mapRecentBlocks;
+
+static CRecentBlock *GetRecentBlock(const uint256 &hash)
+{
+    std::map<uint256, RecentBlockList::iterator>::iterator mi = mapRecentBlocks.find(hash);
+    if (mi == mapRecentBlocks.end())
+        return NULL;
+    listRecentBlocks.splice(listRecentBlocks.begin(), listRecentBlocks, mi->second);
+    return &mi->second->second;
+}
+
+static CRecentBlock &AddRecentBlock(const CBlock &block)
+{
+    uint256 hash = block.GetHash();
+    CRecentBlock *precent = GetRecentBlock(hash);
+    if (precent)
+        return *precent;
+    listRecentBlocks.push_front(std::make_pair(hash, CRecentBlock()));
+    listRecentBlocks.front().second.block = block;
+    mapRecentBlocks[hash] = listRecentBlocks.begin();
+    while (listRecentBlocks.size() > MAX_RECENT_BLOCKS) {
+        mapRecentBlocks.erase(listRecentBlocks.back().first);
+        listRecentBlocks.pop_back();
+    }
+    return listRecentBlocks.front().second;
+}
+
+// Read a block for SetBestChain, from the recent blocks if it is there.
+// fConnected tells whether it was connected before, scripts and all.
+static bool ReadRecentBlock(CBlockIndex *pindex, CBlock &block, bool &fConnected)
+{
+    CRecentBlock *precent = GetRecentBlock(pindex->GetBlockHash());
+    if (precent) {
+        block = precent->block;
+        fConnected = precent->fConnected;
+        return true;
+    }
+    fConnected = false;
+    return block.ReadFromDisk(pindex);
+}
+
 bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
 {
     assert(pindex == view.GetBestBlock());
@@ -1478,12 +2064,19 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    CBlockUndo blockUndoDisk;
+    const CBlockUndo *pblockUndo = &blockUndoDisk;
+    CRecentBlock *precent = GetRecentBlock(pindex->GetBlockHash());
+    if (precent && precent->fConnected)
+        pblockUndo = &precent->undo;
+    else {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        if (!blockUndoDisk.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+    }
+    const CBlockUndo &blockUndo = *pblockUndo;
 
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
@@ -1498,19 +2091,21 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
             view.SetCoins(hash, CCoins());
         }
-        CCoins &outs = view.GetCoins(hash);
-
-        CCoins outsBlock = CCoins(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs.nVersion = outsBlock.nVersion;
-        if (outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs = CCoins();
+        {
+            CCoinsModifier outs = view.ModifyCoins(hash);
+
+            CCoins outsBlock = CCoins(tx, pindex->nHeight);
+            // The CCoins serialization does not serialize negative numbers.
+            // No network rules currently depend on the version here, so an inconsistency is harmless
+            // but it must be corrected before txout nversion ever influences a network rule.
+            if (outsBlock.nVersion < 0)
+                outs->nVersion = outsBlock.nVersion;
+            if (*outs != outsBlock)
+                fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
+
+            // remove outputs
+            *outs = CCoins();
+        }
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -1579,6 +2174,65 @@ void static FlushBlockFile(bool fFinalize = false)
     }
 }
 
+CConnectTimings::CConnectTimings(unsigned int nWindowIn) : nWindow(nWindowIn)
+{
+    for (int i = 0; i < CONNECT_STAGES; i++) {
+        vSamples[i].reserve(nWindow);
+        nCount[i] = 0;
+    }
+}
+
+void CConnectTimings::Add(BlockConnectStage stage, int64 nMicros)
+{
+    LOCK(cs);
+    std::vector<int64> &v = vSamples[stage];
+    if (v.size() < nWindow)
+        v.push_back(nMicros);
+    else if (nWindow > 0)
+        v[nCount[stage] % nWindow] = nMicros;
+    nCount[stage]++;
+}
+
+void CConnectTimings::Get(BlockConnectStage stage, CConnectStageStats &stats) const
+{
+    std::vector<int64> v;
+    {
+        LOCK(cs);
+        v = vSamples[stage];
+        stats.nCount = nCount[stage];
+    }
+    stats.nWindow = v.size();
+    if (v.empty())
+        return;
+    sort(v.begin(), v.end());
+    int64 nSum = 0;
+    BOOST_FOREACH(int64 n, v)
+        nSum += n;
+    stats.nMean = nSum / (int64)v.size();
+    stats.nMin = v.front();
+    stats.nMax = v.back();
+    // Nearest rank
+    stats.nMedian = v[(v.size() - 1) * 50 / 100];
+    stats.n90th = v[(v.size() - 1) * 90 / 100];
+    stats.n99th = v[(v.size() - 1) * 99 / 100];
+}
+
+const char *CConnectTimings::GetStageName(BlockConnectStage stage)
+{
+    switch (stage) {
+    case CONNECT_POW:        return "pow";
+    case CONNECT_CHECKBLOCK: return "checkblock";
+    case CONNECT_INPUTS:     return "inputs";
+    case CONNECT_SCRIPTS:    return "scripts";
+    case CONNECT_UNDO:       return "undo";
+    case CONNECT_INDEX:      return "index";
+    case CONNECT_WALLET:     return "wallet";
+    case CONNECT_TOTAL:      return "connect";
+    case CONNECT_FLUSH:      return "flush";
+    default:                 return "unknown";
+    }
+}
+
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
@@ -1588,10 +2242,97 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+// With -syncinterval (and always during initial block download), block and
+// undo writes are not committed one by one but together by SyncBlockData().
+// Until then a marker in the block tree database holds the positions in the
+// last block file from which data may be lost in a crash. Protected by
+// cs_LastBlockFile.
+static bool fSyncMarker = false;
+static uint64 nUnsyncedBytes = 0;
+static int64 nLastSync = 0;
+
+void CommitBlockWrite(FILE *file, const CDiskBlockPos &pos, unsigned int nSize, bool fUndo)
+{
+    {
+        LOCK(cs_LastBlockFile);
+        // Older files are finalized already, anything written there is committed right away
+        if ((nSyncInterval > 0 || IsInitialBlockDownload()) && pos.nFile == nLastBlockFile) {
+            if (!fSyncMarker) {
+                unsigned int nPos = fUndo ? infoLastBlockFile.nSize : pos.nPos;
+                unsigned int nUndoPos = fUndo ? pos.nPos : infoLastBlockFile.nUndoSize;
+                fSyncMarker = pblocktree->WriteSyncMarker(pos.nFile, nPos, nUndoPos);
+            }
+            if (fSyncMarker) {
+                nUnsyncedBytes += nSize;
+                return;
+            }
+        }
+    }
+    FileCommit(file);
+}
+
+void SyncBlockData()
+{
+    LOCK(cs_LastBlockFile);
+    FlushBlockFile();
+    if (fSyncMarker) {
+        // A synced write also commits every block index write before it
+        pblocktree->EraseSyncMarker();
+        fSyncMarker = false;
+    } else
+        pblocktree->Sync();
+    nUnsyncedBytes = 0;
+    nLastSync = GetTime();
+}
+
+// Whether the batched block data (and with it the coins cache) should be written out now
+bool static IsSyncDue()
+{
+    if (nSyncInterval <= 0)
+        return true;
+    LOCK(cs_LastBlockFile);
+    return nUnsyncedBytes >= nSyncBytes || GetTime() - nLastSync >= nSyncInterval;
+}
+
+bool CheckUnsyncedBlockData()
+{
+    int nFile;
+    unsigned int nPos, nUndoPos;
+    if (!pblocktree->ReadSyncMarker(nFile, nPos, nUndoPos))
+        return true;
+
+    printf("CheckUnsyncedBlockData() : checking data past blk%05u.dat:%u and rev%05u.dat:%u\n", nFile, nPos, nFile, nUndoPos);
+    int nChecked = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        boost::this_thread::interruption_point();
+        const CBlockIndex* pindex = item.second;
+        if (pindex->nFile < nFile)
+            continue;
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) && (pindex->nFile > nFile || pindex->nDataPos >= nPos)) {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+                return error("CheckUnsyncedBlockData() : block %s is incomplete on disk", pindex->GetBlockHash().ToString().c_str());
+            nChecked++;
+        }
+        if ((pindex->nStatus & BLOCK_HAVE_UNDO) && pindex->pprev && (pindex->nFile > nFile || pindex->nUndoPos >= nUndoPos)) {
+            CBlockUndo undo;
+            if (!undo.ReadFromDisk(pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+                return error("CheckUnsyncedBlockData() : undo data of block %s is incomplete on disk", pindex->GetBlockHash().ToString().c_str());
+            nChecked++;
+        }
+    }
+    printf("CheckUnsyncedBlockData() : %i block and undo records intact\n", nChecked);
+
+    return pblocktree->EraseSyncMarker();
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, bool fCheckScripts)
 {
+    int64 nStartConnect = GetTimeMicros();
+
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(state, !fJustCheck && !(pindex->nStatus & BLOCK_VALID_POW), !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -1605,7 +2346,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = fCheckScripts && pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1701,16 +2442,23 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     if (fJustCheck)
         return true;
+    connecttimings.Add(CONNECT_INPUTS, nTime);
+    connecttimings.Add(CONNECT_SCRIPTS, nTime2 - nTime);
 
     // Write undo information to disk
+    int64 nStartIndex = GetTimeMicros();
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
     {
         if (pindex->GetUndoPos().IsNull()) {
+            int64 nStartUndo = GetTimeMicros();
             CDiskBlockPos pos;
             if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
             if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
                 return state.Abort(_("Failed to write undo data"));
+            int64 nTimeUndo = GetTimeMicros() - nStartUndo;
+            connecttimings.Add(CONNECT_UNDO, nTimeUndo);
+            nStartIndex += nTimeUndo;
 
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
@@ -1727,13 +2475,23 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fTxIndex)
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
+    connecttimings.Add(CONNECT_INDEX, GetTimeMicros() - nStartIndex);
 
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
+    CRecentBlock &recent = AddRecentBlock(*this);
+    if (!recent.fConnected) {
+        recent.undo = blockundo;
+        recent.fConnected = true;
+    }
+
     // Watch for transactions paying to me
-    for (unsigned int i=0; i<vtx.size(); i++)
-        SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+    int64 nStartWallet = GetTimeMicros();
+    SyncWithWallets(*this);
+    int64 nTimeEnd = GetTimeMicros();
+    connecttimings.Add(CONNECT_WALLET, nTimeEnd - nStartWallet);
+    connecttimings.Add(CONNECT_TOTAL, nTimeEnd - nStartConnect);
 
     return true;
 }
@@ -1779,7 +2537,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     vector<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        bool fConnected;
+        if (!ReadRecentBlock(pindex, block, fConnected))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
         if (!block.DisconnectBlock(state, pindex, view))
@@ -1799,10 +2558,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     vector<CTransaction> vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        bool fConnected;
+        if (!ReadRecentBlock(pindex, block, fConnected))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        // Its scripts were checked when it was connected before, on the same parent
+        if (!block.ConnectBlock(state, pindex, view, false, !fConnected)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -1827,7 +2588,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if ((!fIsInitialDownload && IsSyncDue()) || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1835,11 +2596,11 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error();
-        FlushBlockFile();
-        pblocktree->Sync();
+        SyncBlockData();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
     }
+    connecttimings.Add(CONNECT_FLUSH, GetTimeMicros() - nStart);
 
     // At this point, all changes have been done to the database.
     // Proceed by updating the memory structures.
@@ -1878,11 +2639,16 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetBlockIndexByHeight(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    {
+        // Wake up getblocktemplate long polls
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -1937,12 +2703,12 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
     pindexNew->nTx = vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
-    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA | BLOCK_VALID_POW;
     setBlockIndexValid.insert(pindexNew);
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
@@ -2067,6 +2833,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
+    int64 nStartCheck = GetTimeMicros();
 
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
@@ -2091,8 +2858,14 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     }
 
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
-        return state.DoS(50, error("CheckBlock() : proof of work failed"));
+    int64 nTimePoW = 0;
+    if (fCheckPOW) {
+        int64 nStartPoW = GetTimeMicros();
+        if (!CheckBlockProofOfWork(*this))
+            return state.DoS(50, error("CheckBlock() : proof of work failed"));
+        nTimePoW = GetTimeMicros() - nStartPoW;
+        connecttimings.Add(CONNECT_POW, nTimePoW);
+    }
 
     // Check timestamp
     if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
@@ -2110,10 +2883,11 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         if (!tx.CheckTransaction(state))
             return error("CheckBlock() : CheckTransaction failed");
 
-    // Build the merkle tree already. We need it anyway later, and it makes the
-    // block cache the transaction hashes, which means they don't need to be
-    // recalculated many times during this block's validation.
-    BuildMerkleTree();
+    // Build the merkle tree already (unless PreCheckBlocks did). We need it
+    // anyway later, and it makes the block cache the transaction hashes, which
+    // means they don't need to be recalculated many times during this block's
+    // validation.
+    uint256 hashMerkleRootBuilt = fPreChecked ? vMerkleTree.back() : BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2133,9 +2907,10 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    connecttimings.Add(CONNECT_CHECKBLOCK, GetTimeMicros() - nStartCheck - nTimePoW);
     return true;
 }
 
@@ -2212,6 +2987,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (dbp == NULL)
             if (!WriteToDisk(blockPos))
                 return state.Abort(_("Failed to write block"));
+        // Connecting it next does not need to read it back
+        AddRecentBlock(*this);
         if (!AddToBlockIndex(state, blockPos))
             return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
@@ -2265,9 +3042,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         {
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"));
         }
-        CBigNum bnNewBlock;
+        uint256 bnNewBlock;
         bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
         if (bnNewBlock > bnRequired)
         {
@@ -2359,6 +3136,131 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    RAND_bytes((unsigned char*)&nNonce, sizeof(nNonce));
+
+    // The receiver can't have the coinbase
+    CPrefilledTransaction prefilled;
+    prefilled.nIndex = 0;
+    prefilled.tx = block.vtx[0];
+    vPrefilledTxn.push_back(prefilled);
+
+    uint256 hashKey = GetShortTxIDKey();
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortTxID(hashKey, block.vtx[i].GetHash()));
+}
+
+uint256 CCompactBlock::GetShortTxIDKey() const
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    return Hash(ss.begin(), ss.end());
+}
+
+uint64 CCompactBlock::GetShortTxID(const uint256& hashKey, const uint256& txhash)
+{
+    // Two seeded MurmurHash3 runs, as bloom filters use, cut down to 6 bytes
+    uint64 nKey = hashKey.Get64(0);
+    std::vector<unsigned char> vchTxHash(txhash.begin(), txhash.end());
+    uint64 nHigh = MurmurHash3((unsigned int)nKey, vchTxHash);
+    uint64 nLow = MurmurHash3((unsigned int)(nKey >> 32), vchTxHash);
+    return ((nHigh << 32) | nLow) & 0xffffffffffffULL;
+}
+
+bool CPartialBlock::Init(const CCompactBlock& cmpctblock, CTxMemPool& pool)
+{
+    unsigned int nTx = cmpctblock.GetTransactionCount();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return false;
+
+    header = cmpctblock.header;
+    vtx.assign(nTx, CTransaction());
+    vHave.assign(nTx, false);
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return false;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The short ids take the positions left, in order
+    map<uint64, unsigned int> mapShortTxIDs;
+    unsigned int nPos = 0;
+    BOOST_FOREACH(uint64 nShortTxID, cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nPos])
+            nPos++;
+        if (!mapShortTxIDs.insert(make_pair(nShortTxID, nPos)).second)
+            return false;
+        nPos++;
+    }
+
+    // Two memory pool transactions with the id of one position: ask for it
+    vector<bool> vCollided(nTx, false);
+    uint256 hashKey = cmpctblock.GetShortTxIDKey();
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned int>::const_iterator it = mapShortTxIDs.find(CCompactBlock::GetShortTxID(hashKey, (*mi).first));
+            if (it == mapShortTxIDs.end())
+                continue;
+            unsigned int nMatch = (*it).second;
+            if (vCollided[nMatch])
+                continue;
+            if (vHave[nMatch])
+            {
+                vCollided[nMatch] = true;
+                vHave[nMatch] = false;
+                vtx[nMatch] = CTransaction();
+                continue;
+            }
+            vtx[nMatch] = (*mi).second;
+            vHave[nMatch] = true;
+        }
+    }
+    return true;
+}
+
+std::vector<unsigned int> CPartialBlock::GetMissing() const
+{
+    std::vector<unsigned int> vMissing;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return vMissing;
+}
+
+bool CPartialBlock::FillMissing(const std::vector<CTransaction>& vtxMissing)
+{
+    std::vector<unsigned int> vMissing = GetMissing();
+    if (vMissing.size() != vtxMissing.size())
+        return false;
+    for (unsigned int i = 0; i < vMissing.size(); i++)
+    {
+        vtx[vMissing[i]] = vtxMissing[i];
+        vHave[vMissing[i]] = true;
+    }
+    return true;
+}
+
+bool CPartialBlock::GetBlock(CBlock& block) const
+{
+    if (vtx.empty() || !GetMissing().empty())
+        return false;
+    block = CBlock(header);
+    block.vtx = vtx;
+    return block.BuildMerkleTree() == header.hashMerkleRoot;
+}
+
+
+
+
+
 
 
 
@@ -2536,6 +3438,85 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "rev", fReadOnly);
 }
 
+// Finished block files no longer change, so they can stay mapped. The most
+// recently used ones are kept; 32-bit builds lack the address space for many.
+static const unsigned int MAX_MAPPED_BLOCKFILES = sizeof(void*) >= 8 ? 16 : 2;
+
+class CBlockFileRegion : public CBlockFileMapping
+{
+private:
+    boost::interprocess::file_mapping file;
+    boost::interprocess::mapped_region region;
+
+public:
+    CBlockFileRegion(const boost::filesystem::path &path) :
+        file(path.string().c_str(), boost::interprocess::read_only),
+        region(file, boost::interprocess::read_only) {
+        pbegin = static_cast<const char*>(region.get_address());
+        nSize = region.get_size();
+    }
+};
+
+static CCriticalSection cs_listMappedBlockFiles;
+static list<pair<int, boost::shared_ptr<const CBlockFileMapping> > > listMappedBlockFiles;
+
+boost::shared_ptr<const CBlockFileMapping> MapBlockFile(int nFile)
+{
+    bool fFinished;
+    {
+        LOCK(cs_LastBlockFile);
+        fFinished = nFile < nLastBlockFile;
+    }
+
+    LOCK(cs_listMappedBlockFiles);
+    boost::shared_ptr<const CBlockFileMapping> mapping;
+    for (list<pair<int, boost::shared_ptr<const CBlockFileMapping> > >::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); it++) {
+        if (it->first == nFile) {
+            mapping = it->second;
+            listMappedBlockFiles.erase(it);
+            break;
+        }
+    }
+    // A reindex can make an earlier file the one being appended to again
+    if (!fFinished)
+        return boost::shared_ptr<const CBlockFileMapping>();
+
+    if (!mapping) {
+        boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+        try {
+            mapping.reset(new CBlockFileRegion(path));
+        } catch (std::exception &e) {
+            printf("Unable to map %s: %s\n", path.string().c_str(), e.what());
+            return mapping;
+        }
+    }
+    listMappedBlockFiles.push_front(make_pair(nFile, mapping));
+    if (listMappedBlockFiles.size() > MAX_MAPPED_BLOCKFILES)
+        listMappedBlockFiles.pop_back();
+    return mapping;
+}
+
+bool GetMappedBlock(const CDiskBlockPos &pos, boost::shared_ptr<const CBlockFileMapping> &mapping, const char *&pchBlock, unsigned int &nBlockSize)
+{
+    if (pos.IsNull())
+        return false;
+    mapping = MapBlockFile(pos.nFile);
+    if (!mapping)
+        return false;
+
+    // The block follows the message start and its size, see CBlock::WriteToDisk
+    if (pos.nPos < 8 || pos.nPos > mapping->size())
+        return false;
+    const char *pchHeader = mapping->begin() + pos.nPos - 8;
+    if (memcmp(pchHeader, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return false;
+    memcpy(&nBlockSize, pchHeader + 4, sizeof(nBlockSize));
+    if (nBlockSize > mapping->size() - pos.nPos)
+        return false;
+    pchBlock = mapping->begin() + pos.nPos;
+    return true;
+}
+
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -2575,7 +3556,7 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
@@ -2616,6 +3597,7 @@ bool static LoadBlockIndexDB()
          pindexPrev->pnext = pindex;
          pindex = pindexPrev;
     }
+    SetBlockIndexByHeight(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2650,7 +3632,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         if (!block.ReadFromDisk(pindex))
             return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state))
+        if (nCheckLevel >= 1 && !block.CheckBlock(state, !(pindex->nStatus & BLOCK_VALID_POW)))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 2: verify undo validity
         if (nCheckLevel >= 2 && pindex) {
@@ -2662,7 +3644,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2706,6 +3688,7 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    vBlockIndexByHeight.clear();
 }
 
 bool LoadBlockIndex()
@@ -2870,13 +3853,91 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+//
+// Block import pipeline. Scanner threads each take the next file, locate and
+// deserialize its blocks, pre-check them in parallel and queue them in
+// batches. The importing thread connects the batches file by file, in order.
+//
+
+// Blocks read from one file, in file order
+struct CImportBatch
 {
-    int64 nStart = GetTimeMillis();
+    std::deque<CBlock> vBlocks;
+    std::vector<uint64> vBlockPos;
+    unsigned int nSize;
 
-    int nLoaded = 0;
+    CImportBatch() : nSize(0) { }
+
+    void swap(CImportBatch &batch) {
+        vBlocks.swap(batch.vBlocks);
+        vBlockPos.swap(batch.vBlockPos);
+        std::swap(nSize, batch.nSize);
+    }
+};
+
+// A file to import: an external one, or one of our own block files when
+// reindexing, whose blocks are then indexed where they are
+struct CImportSource
+{
+    FILE *file;
+    CDiskBlockPos pos;
+    std::list<CImportBatch> listBatches; // read, waiting to be connected
+    bool fDone;                          // all of it was read
+
+    CImportSource(FILE *fileIn, const CDiskBlockPos &posIn) : file(fileIn), pos(posIn), fDone(false) { }
+};
+
+class CBlockImport
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condQueued;    // a batch was queued, or a file finished
+    boost::condition_variable condDequeued;  // room was made for a batch
+    std::vector<CImportSource> vSources;
+    unsigned int nNextScan;
+    bool fQuit;
+
+    CBlockImport() : nNextScan(0), fQuit(false) { }
+};
+
+// Pre-check a batch and wait for room to queue it. False if the import stopped.
+bool static QueueImportBatch(CBlockImport &import, CImportSource &source, CImportBatch &batch)
+{
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<const CBlock*> vpblock;
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(const CBlock& block, batch.vBlocks) {
+            if (mapBlockIndex.count(block.GetHash()))
+                continue;
+            vHeaders.push_back(block.GetBlockHeader());
+            vpblock.push_back(&block);
+        }
+    }
+    PreCheckBlocks(vHeaders, vpblock);
+
+    boost::unique_lock<boost::mutex> lock(import.mutex);
+    while (source.listBatches.size() >= MAX_IMPORT_QUEUED_BATCHES && !import.fQuit)
+        import.condDequeued.wait(lock);
+    if (import.fQuit)
+        return false;
+    source.listBatches.push_back(CImportBatch());
+    source.listBatches.back().swap(batch);
+    import.condQueued.notify_all();
+    return true;
+}
+
+void static ScanImportSource(CBlockImport &import, CImportSource &source)
+{
+    CDiskBlockPos *dbp = source.pos.IsNull() ? NULL : &source.pos;
+    if (!source.file && dbp)
+        source.file = OpenBlockFile(*dbp, true);
+
+    CImportBatch batch;
     try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        if (!source.file)
+            throw std::runtime_error("ScanImportSource() : unable to open file");
+        CBufferedFile blkdat(source.file, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
             // (try to) skip already indexed part
@@ -2906,42 +3967,223 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat >> nSize;
                 if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
                     continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
+            } catch (std::exception &e) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block
+                uint64 nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                batch.vBlocks.resize(batch.vBlockPos.size() + 1);
+                blkdat >> batch.vBlocks.back();
+                nRewind = blkdat.GetPos();
+
+                // queue block for processing
+                if (nBlockPos >= nStartByte) {
+                    batch.vBlockPos.push_back(nBlockPos);
+                    batch.nSize += nSize;
+                } else {
+                    batch.vBlocks.pop_back();
+                }
+            } catch (std::exception &e) {
+                batch.vBlocks.resize(batch.vBlockPos.size());
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+            if (batch.vBlocks.size() >= MAX_PRECHECK_BLOCKS || batch.nSize >= MAX_PRECHECK_BYTES) {
+                if (!QueueImportBatch(import, source, batch))
+                    return;
+            }
+        }
+        if (!batch.vBlocks.empty())
+            QueueImportBatch(import, source, batch);
+    } catch(std::runtime_error &e) {
+        AbortNode(_("Error: system error: ") + e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(import.mutex);
+    source.fDone = true;
+    import.condQueued.notify_all();
+}
+
+void static ThreadImportScan(CBlockImport *pimport)
+{
+    RenameThread("bitcoin-loadscan");
+    while (true) {
+        CImportSource *psource;
+        {
+            boost::unique_lock<boost::mutex> lock(pimport->mutex);
+            if (pimport->fQuit || pimport->nNextScan == pimport->vSources.size())
+                return;
+            psource = &pimport->vSources[pimport->nNextScan++];
+        }
+        ScanImportSource(*pimport, *psource);
+    }
+}
+
+// Hand a batch of pre-checked blocks to ProcessBlock in file order. Blocks of
+// our own files that come before their parent are remembered by position and
+// read again once the parent is in, rather than kept as orphans in memory.
+// Returns false on a state error.
+bool static ConnectImportBatch(CImportBatch &batch, CDiskBlockPos *dbp, int& nLoaded, std::multimap<uint256, CDiskBlockPos> &mapBlocksUnknownParent)
+{
+    for (unsigned int i = 0; i < batch.vBlocks.size(); i++) {
+        try {
+            LOCK(cs_main);
+            CBlock &block = batch.vBlocks[i];
+            if (dbp) {
+                dbp->nPos = batch.vBlockPos[i];
+                if (block.GetHash() != hashGenesisBlock && !mapBlockIndex.count(block.hashPrevBlock)) {
+                    mapBlocksUnknownParent.insert(make_pair(block.hashPrevBlock, *dbp));
+                    continue;
+                }
             }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+            CValidationState state;
+            if (ProcessBlock(state, NULL, &block, dbp))
+                nLoaded++;
+            if (state.IsError())
+                return false;
+            if (!dbp || mapBlocksUnknownParent.empty())
+                continue;
 
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
+            std::deque<uint256> queueParents;
+            queueParents.push_back(block.GetHash());
+            while (!queueParents.empty()) {
+                uint256 hashParent = queueParents.front();
+                queueParents.pop_front();
+                std::multimap<uint256, CDiskBlockPos>::iterator it = mapBlocksUnknownParent.lower_bound(hashParent);
+                while (it != mapBlocksUnknownParent.end() && it->first == hashParent) {
+                    CDiskBlockPos posChild = it->second;
+                    mapBlocksUnknownParent.erase(it++);
+                    CBlock blockChild;
+                    if (!blockChild.ReadFromDisk(posChild))
+                        continue;
+                    CValidationState stateChild;
+                    if (ProcessBlock(stateChild, NULL, &blockChild, &posChild)) {
                         nLoaded++;
-                    if (state.IsError())
-                        break;
+                        queueParents.push_back(blockChild.GetHash());
+                    }
+                    if (stateChild.IsError())
+                        return false;
                 }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
+        } catch (std::exception &e) {
+            printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
         }
-        fclose(fileIn);
-    } catch(std::runtime_error &e) {
-        AbortNode(_("Error: system error: ") + e.what());
     }
+    return true;
+}
+
+bool static ImportBlocks(CBlockImport &import)
+{
+    int64 nStart = GetTimeMillis();
+
+    unsigned int nThreads = std::min((unsigned int)import.vSources.size(), std::max(boost::thread::hardware_concurrency(), 1U));
+    nThreads = std::min(nThreads, (unsigned int)MAX_IMPORT_SCAN_THREADS);
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadImportScan, &import));
+
+    int nLoaded = 0;
+    bool fOk = true;
+    std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    try {
+        for (unsigned int nSource = 0; fOk && nSource < import.vSources.size(); ) {
+            CImportSource &source = import.vSources[nSource];
+            CImportBatch batch;
+            {
+                boost::unique_lock<boost::mutex> lock(import.mutex);
+                while (source.listBatches.empty() && !source.fDone)
+                    import.condQueued.wait(lock);
+                if (source.listBatches.empty()) {
+                    nSource++;
+                    continue;
+                }
+                batch.swap(source.listBatches.front());
+                source.listBatches.pop_front();
+                import.condDequeued.notify_all();
+            }
+            CDiskBlockPos pos = source.pos;
+            fOk = ConnectImportBatch(batch, pos.IsNull() ? NULL : &pos, nLoaded, mapBlocksUnknownParent);
+        }
+    } catch (boost::thread_interrupted) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CImportSource &source, import.vSources)
+            if (source.file)
+                fclose(source.file);
+        throw;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(import.mutex);
+        import.fQuit = true;
+        import.condDequeued.notify_all();
+    }
+    threadGroup.join_all();
+    BOOST_FOREACH(CImportSource &source, import.vSources)
+        if (source.file)
+            fclose(source.file);
+
     if (nLoaded > 0)
-        printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
+        printf("Loaded %i blocks from %"PRIszu" file(s) with %u thread(s) in %"PRI64d"ms\n", nLoaded, import.vSources.size(), nThreads, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
+bool LoadExternalBlockFiles(const std::vector<FILE*>& vFiles)
+{
+    CBlockImport import;
+    BOOST_FOREACH(FILE* file, vFiles)
+        import.vSources.push_back(CImportSource(file, CDiskBlockPos()));
+    return ImportBlocks(import);
+}
+
+bool ReindexBlockFiles(int nFiles)
+{
+    CBlockImport import;
+    for (int nFile = 0; nFile < nFiles; nFile++)
+        import.vSources.push_back(CImportSource(NULL, CDiskBlockPos(nFile, 0)));
+    return ImportBlocks(import);
+}
+
+bool LoadTxOutSet(const boost::filesystem::path &path)
+{
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadTxOutSet() : cannot open %s", path.string().c_str());
+
+    int64 nStart = GetTimeMillis();
+    CCoinsStats stats;
+    if (!pcoinsdbview->VerifyTxOutSet(filein, stats))
+        return error("LoadTxOutSet() : %s is not a valid UTXO snapshot", path.string().c_str());
+    printf("LoadTxOutSet() : snapshot at block %s with %"PRI64u" transactions verified in %"PRI64d"ms\n",
+        stats.hashBlock.ToString().c_str(), stats.nTransactions, GetTimeMillis() - nStart);
+
+    // The chain continues from the snapshot block, so it has to be stored
+    // and valid as far as we know. Its scripts are not checked again.
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("LoadTxOutSet() : snapshot block %s is not in the block index", stats.hashBlock.ToString().c_str());
+        CBlockIndex *pindex = mi->second;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || (pindex->nStatus & BLOCK_FAILED_MASK))
+            return error("LoadTxOutSet() : snapshot block %s is missing or invalid", stats.hashBlock.ToString().c_str());
+        if (pindexBest && pindexBest->nChainWork >= pindex->nChainWork) {
+            printf("LoadTxOutSet() : chain is already past the snapshot, not loading it\n");
+            return true;
+        }
+    }
+
+    nStart = GetTimeMillis();
+    fseek(filein, 0, SEEK_SET);
+    CCoinsStats statsLoaded;
+    if (!pcoinsdbview->LoadTxOutSet(filein, statsLoaded))
+        return error("LoadTxOutSet() : importing %s failed", path.string().c_str());
+    printf("LoadTxOutSet() : imported in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 
 
 
@@ -2979,7 +4221,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3051,6 +4293,99 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xfb, 0xc0, 0xb6, 0xdb }; // LitecoinDark: increase each by adding 2 to bitcoin's value.
 
 
+// Read the serialized block at pos from the block file being written to,
+// which is not mapped, without deserializing it
+bool static ReadRawBlockFromDisk(const CDiskBlockPos &pos, std::vector<char> &vchBlock)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    try {
+        unsigned char pchMessageStartFile[4];
+        unsigned int nBlockSize;
+        filein >> FLATDATA(pchMessageStartFile) >> nBlockSize;
+        if (memcmp(pchMessageStartFile, pchMessageStart, sizeof(pchMessageStart)) != 0 || nBlockSize > MAX_BLOCK_SIZE)
+            return false;
+        vchBlock.resize(nBlockSize);
+        filein.read(&vchBlock[0], nBlockSize);
+    } catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
+// Send a block to a peer the way it is stored on disk, instead of
+// deserializing it only to serialize it again
+// The block message sent last. A new block is asked for by all peers at
+// about the same time; it is read and checksummed for the first of them.
+static CCriticalSection cs_LastBlockMessage;
+static uint256 hashLastBlockMessage;
+static CSendBufferRef bufferLastBlockMessage;
+static uint256 hashLastCompactBlockMessage;
+static CSendBufferRef bufferLastCompactBlockMessage;
+
+bool static PushRawBlock(CNode* pfrom, const CBlockIndex* pindex)
+{
+    {
+        LOCK(cs_LastBlockMessage);
+        if (bufferLastBlockMessage && hashLastBlockMessage == pindex->GetBlockHash()) {
+            pfrom->PushSendBuffer(bufferLastBlockMessage);
+            return true;
+        }
+    }
+
+    boost::shared_ptr<const CBlockFileMapping> mapping;
+    const char *pchBlock;
+    unsigned int nBlockSize;
+    std::vector<char> vchBlock;
+    if (!GetMappedBlock(pindex->GetBlockPos(), mapping, pchBlock, nBlockSize)) {
+        if (!ReadRawBlockFromDisk(pindex->GetBlockPos(), vchBlock) || vchBlock.empty())
+            return false;
+        pchBlock = &vchBlock[0];
+        nBlockSize = vchBlock.size();
+    }
+
+    // The header hash is cheap, and catches a position that is off
+    if (nBlockSize < 80 || Hash(pchBlock, pchBlock + 80) != pindex->GetBlockHash())
+        return error("PushRawBlock() : block %s not found at its position on disk", pindex->GetBlockHash().ToString().c_str());
+    CSendBufferRef buffer = MakeSendBuffer("block", pchBlock, nBlockSize);
+    {
+        LOCK(cs_LastBlockMessage);
+        hashLastBlockMessage = pindex->GetBlockHash();
+        bufferLastBlockMessage = buffer;
+    }
+    pfrom->PushSendBuffer(buffer);
+    return true;
+}
+
+// Send a block as a compact block, built once for all the peers asking
+bool static PushCompactBlock(CNode* pfrom, const CBlockIndex* pindex)
+{
+    {
+        LOCK(cs_LastBlockMessage);
+        if (bufferLastCompactBlockMessage && hashLastCompactBlockMessage == pindex->GetBlockHash()) {
+            pfrom->PushSendBuffer(bufferLastCompactBlockMessage);
+            return true;
+        }
+    }
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex) || block.vtx.empty())
+        return false;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CCompactBlock(block);
+    CSendBufferRef buffer = MakeSendBuffer("cmpctblock", &ss[0], ss.size());
+    {
+        LOCK(cs_LastBlockMessage);
+        hashLastCompactBlockMessage = pindex->GetBlockHash();
+        bufferLastCompactBlockMessage = buffer;
+    }
+    pfrom->PushSendBuffer(buffer);
+    return true;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3073,36 +4408,53 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                pfrom->nBlocksRequested++;
-                if (mi != mapBlockIndex.end())
+                // Only the lookup needs cs_main: block index entries are never
+                // freed, and reading the block and building the reply don't.
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                int nHeightBest;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = ((*mi).second)->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                       if (!((*mi).second)->IsInMainChain())
-                       {
-                         printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
-                         send = false;
-                       }
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = (*mi).second;
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                        if (pcheckpoint && pindex->nHeight < pcheckpoint->nHeight) {
+                           if (!pindex->IsInMainChain())
+                           {
+                             printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                             pindex = NULL;
+                           }
+                        }
                     }
-                } else {
-                    send = false;
+                    hashBest = hashBestChain;
+                    nHeightBest = nBestHeight;
                 }
-                if (send)
+                pfrom->nBlocksRequested++;
+                if (pindex)
                 {
                     // Send block from disk
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Old blocks go out in full even when asked for as compact
+                        // blocks: the peer is catching up and won't have their transactions
+                        bool fCompact = (inv.type == MSG_CMPCT_BLOCK && pindex->nHeight >= nHeightBest - MAX_CMPCTBLOCK_DEPTH);
+                        // Full blocks go out as stored, without deserializing them
+                        if ((!fCompact || !PushCompactBlock(pfrom, pindex)) && !PushRawBlock(pfrom, pindex))
+                        {
+                            block.ReadFromDisk(pindex);
+                            pfrom->PushMessage("block", block);
+                        }
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        block.ReadFromDisk(pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3130,7 +4482,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3142,9 +4494,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSendBufferRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSendBuffer((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3186,6 +4538,39 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Compact blocks waiting for the transactions asked for with getblocktxn,
+// by block hash. The peer is only compared against, never dereferenced.
+struct CPendingCompactBlock
+{
+    CPartialBlock partial;
+    CNode* pfrom;
+    int64 nTimeRequested;
+};
+static map<uint256, CPendingCompactBlock> mapPendingCompactBlocks;
+
+// Hand a compact block that was filled in to ProcessBlock, or ask for the
+// full block if it came out wrong
+void static ProcessCompactBlock(CNode* pfrom, const CPartialBlock& partial)
+{
+    CInv inv(MSG_BLOCK, partial.header.GetHash());
+    CBlock block;
+    if (!partial.GetBlock(block))
+    {
+        // A short id matched the wrong memory pool transaction, nobody's fault
+        printf("compact block %s did not reconstruct, asking for it in full\n", inv.hash.ToString().c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return;
+    }
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3636,9 +5021,120 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        pfrom->AddInventoryKnown(inv);
+        printf("received compact block %s\n", inv.hash.ToString().c_str());
+
+        // Forget requests the peers never answered
+        int64 nNow = GetTime();
+        for (map<uint256, CPendingCompactBlock>::iterator mi = mapPendingCompactBlocks.begin(); mi != mapPendingCompactBlocks.end(); )
+        {
+            if ((*mi).second.nTimeRequested < nNow - CMPCTBLOCK_TIMEOUT)
+                mapPendingCompactBlocks.erase(mi++);
+            else
+                mi++;
+        }
+
+        CPartialBlock partial;
+        if (AlreadyHave(inv) || mapPendingCompactBlocks.count(inv.hash))
+        {
+            // another peer was quicker
+        }
+        else if (!CheckBlockProofOfWork(cmpctblock.header))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+        else if (!partial.Init(cmpctblock, mempool) || mapPendingCompactBlocks.size() >= MAX_PENDING_CMPCTBLOCKS)
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        else
+        {
+            CBlockTransactionsRequest req;
+            req.blockhash = inv.hash;
+            req.vIndexes = partial.GetMissing();
+            if (fDebug)
+                printf("compact block %s: %u of %"PRIszu" transactions missing\n", inv.hash.ToString().c_str(),
+                       (unsigned int)req.vIndexes.size(), partial.vtx.size());
+            if (req.vIndexes.empty())
+                ProcessCompactBlock(pfrom, partial);
+            else
+            {
+                CPendingCompactBlock& pending = mapPendingCompactBlocks[inv.hash];
+                pending.partial = partial;
+                pending.pfrom = pfrom;
+                pending.nTimeRequested = nNow;
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        CBlock block;
+        if (mi == mapBlockIndex.end() || (*mi).second->nHeight < nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+        {
+            // Only recent blocks are sent as compact blocks
+            printf("ignoring getblocktxn for unknown or old block %s\n", req.blockhash.ToString().c_str());
+        }
+        else if (block.ReadFromDisk((*mi).second))
+        {
+            CBlockTransactions resp;
+            resp.blockhash = req.blockhash;
+            BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+            {
+                if (nIndex >= block.vtx.size())
+                {
+                    pfrom->Misbehaving(100);
+                    return error("message getblocktxn : index %u out of range", nIndex);
+                }
+                resp.vtx.push_back(block.vtx[nIndex]);
+            }
+            pfrom->PushMessage("blocktxn", resp);
+        }
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, CPendingCompactBlock>::iterator mi = mapPendingCompactBlocks.find(resp.blockhash);
+        if (mi == mapPendingCompactBlocks.end() || (*mi).second.pfrom != pfrom)
+        {
+            // not asked for, or asked of another peer
+        }
+        else
+        {
+            CPartialBlock partial = (*mi).second.partial;
+            mapPendingCompactBlocks.erase(mi);
+            if (partial.FillMissing(resp.vtx))
+                ProcessCompactBlock(pfrom, partial);
+            else
+            {
+                pfrom->Misbehaving(10);
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            }
+        }
+    }
+
+
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3791,6 +5287,48 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 }
 
 // requires LOCK(cs_vRecvMsg)
+// Block messages queued behind each other (as during initial block download)
+// get their proof of work verified in parallel up front, so that ProcessBlock
+// only has to look the result up.
+static void PreCheckBlockMessages(CNode* pfrom)
+{
+    std::vector<CBlockHeader> vHeaders;
+    for (std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin(); it != pfrom->vRecvMsg.end() && it->complete(); it++) {
+        CNetMessage& msg = *it;
+        if (msg.fPreChecked)
+            continue;
+        msg.fPreChecked = true;
+        if (msg.hdr.GetCommand() != "block" || msg.vRecv.size() < 80)
+            continue;
+        try {
+            CDataStream ssHeader(msg.vRecv.begin(), msg.vRecv.begin() + 80, msg.vRecv.GetType(), msg.vRecv.GetVersion());
+            CBlockHeader header;
+            ssHeader >> header;
+            vHeaders.push_back(header);
+        } catch (std::exception &e) {
+            // leave it to ProcessMessage to complain
+        }
+    }
+    if (vHeaders.size() > 1)
+        PreCheckBlocks(vHeaders, std::vector<const CBlock*>());
+}
+
+// Messages that only touch the peer, the address manager, the memory pool
+// or relay memory, which have their own locks. The message handler threads
+// process these for different peers at once; everything else, validation
+// above all, goes through cs_main one message at a time.
+bool static IsMessageWithoutMain(const std::string& strCommand)
+{
+    return strCommand == "ping" ||
+           strCommand == "addr" ||
+           strCommand == "getaddr" ||
+           strCommand == "getdata" ||
+           strCommand == "mempool" ||
+           strCommand == "filterload" ||
+           strCommand == "filteradd" ||
+           strCommand == "filterclear";
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //if (fDebug)
@@ -3812,6 +5350,8 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    PreCheckBlockMessages(pfrom);
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -3868,6 +5408,9 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (IsMessageWithoutMain(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -3956,7 +5499,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3975,6 +5521,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_vAddrToSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4062,9 +5609,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+            CInv inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(inv))
             {
+                // Peers that know compact blocks send a new block as short
+                // transaction ids. The memory pool has none of the initial
+                // download's transactions, ask for those in full.
+                if (inv.type == MSG_BLOCK && fCompactBlocks && pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload())
+                    inv.type = MSG_CMPCT_BLOCK;
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
                 vGetData.push_back(inv);
@@ -4137,36 +5689,11 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4189,7 +5716,7 @@ public:
     }
 };
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, const CBlockTemplate* pblocktemplatePrev)
 {
     // Create new block
     std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
@@ -4231,104 +5758,115 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         CBlockIndex* pindexPrev = pindexBest;
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority");
 
-        // This vector will be sorted into a priority queue:
+        // Transactions are taken from the memory pool's priority (later fee
+        // rate) index in order. One that spends outputs of other memory pool
+        // transactions waits in mapDependers until all of those made it into
+        // the block, and then competes from vecPriority.
+        mempool.updateIndexes(pindexPrev->nHeight, view);
+        set<const CTxMemPoolEntry*> setSeen;
+        set<uint256> setInBlock;
+        map<uint256, vector<const CTxMemPoolEntry*> > mapDependers;
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+
+        // Collect transactions into block
+        uint64 nBlockSize = 1000;
+        uint64 nBlockTx = 0;
+        int nBlockSigOps = 100;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+        // Start from what a previous template on the same tip still has in
+        // the memory pool. Those transactions were checked against the same
+        // coins, so only their inputs need to be looked up again; dropping a
+        // conflicted one drops everything in the template that spends it.
+        if (pblocktemplatePrev && pblocktemplatePrev->block.hashPrevBlock == pindexPrev->GetBlockHash())
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+            const CBlock& blockPrev = pblocktemplatePrev->block;
+            for (unsigned int i = 1; i < blockPrev.vtx.size(); i++)
+            {
+                const CTransaction& tx = blockPrev.vtx[i];
+                map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.find(tx.GetHash());
+                if (mi == mempool.mapEntry.end() || !mi->second.fIndexed)
+                    continue;
+                const CTxMemPoolEntry* pentry = &mi->second;
+                bool fParentsIn = true;
+                BOOST_FOREACH(const uint256& hashParent, pentry->setMemPoolParents)
+                    fParentsIn &= setInBlock.count(hashParent) > 0;
+                if (!fParentsIn || !tx.HaveInputs(view))
+                    continue;
+                setSeen.insert(pentry);
+
+                CValidationState state;
+                CTxUndo txundo;
+                tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, pentry->hash);
+
+                pblock->vtx.push_back(tx);
+                pblocktemplate->vTxFees.push_back(pblocktemplatePrev->vTxFees[i]);
+                pblocktemplate->vTxSigOps.push_back(pblocktemplatePrev->vTxSigOps[i]);
+                nBlockSize += pentry->nTxSize;
+                ++nBlockTx;
+                nBlockSigOps += pblocktemplatePrev->vTxSigOps[i];
+                nFees += pblocktemplatePrev->vTxFees[i];
+                setInBlock.insert(pentry->hash);
+            }
+            fSortedByFee |= (nBlockSize >= nBlockPrioritySize);
+        }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        TxPriorityCompare comparer(fSortedByFee);
+        const CTxMemPool::indexed_entries *pindexed = fSortedByFee ? &mempool.setByFeeRate : &mempool.setByPriority;
+        CTxMemPool::indexed_entries::const_reverse_iterator it = pindexed->rbegin();
+
+        while (true)
+        {
+            // Skip what was dealt with already or has to wait for dependencies
+            for (; it != pindexed->rend(); it++)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
+                const CTxMemPoolEntry* pentry = *it;
+                if (setSeen.count(pentry))
+                    continue;
+                if (!pentry->ptx->IsFinal())
                 {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
+                    setSeen.insert(pentry);
+                    continue;
+                }
+                bool fWaiting = false;
+                BOOST_FOREACH(const uint256& hashParent, pentry->setMemPoolParents)
+                {
+                    if (!setInBlock.count(hashParent))
                     {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
+                        mapDependers[hashParent].push_back(pentry);
+                        fWaiting = true;
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
+                if (!fWaiting)
+                    break;
+                setSeen.insert(pentry);
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
 
-            if (porphan)
+            // Take highest priority transaction from either the index or the queue of released dependers
+            const CTxMemPoolEntry* pentry;
+            if (it != pindexed->rend() && (vecPriority.empty() || !comparer(TxPriority((*it)->dPriority, (*it)->dFeePerKb, *it), vecPriority.front())))
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                pentry = *it;
+                it++;
+            }
+            else if (!vecPriority.empty())
+            {
+                pentry = vecPriority.front().get<2>();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+                break;
+            setSeen.insert(pentry);
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            double dPriority = pentry->dPriority;
+            double dFeePerKb = pentry->dFeePerKb;
+            const CTransaction& tx = *pentry->ptx;
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -4349,6 +5887,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
                 std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                pindexed = &mempool.setByFeeRate;
+                it = pindexed->rbegin();
             }
 
             if (!tx.HaveInputs(view))
@@ -4365,7 +5905,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 continue;
 
             CTxUndo txundo;
-            uint256 hash = tx.GetHash();
+            const uint256& hash = pentry->hash;
             tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
             // Added
@@ -4376,28 +5916,29 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       dPriority, dFeePerKb, hash.ToString().c_str());
             }
 
             // Add transactions that depend on this one to the priority queue
             if (mapDependers.count(hash))
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                BOOST_FOREACH(const CTxMemPoolEntry* pdepender, mapDependers[hash])
                 {
-                    if (!porphan->setDependsOn.empty())
+                    bool fReady = true;
+                    BOOST_FOREACH(const uint256& hashParent, pdepender->setMemPoolParents)
+                        fReady &= setInBlock.count(hashParent) > 0;
+                    if (fReady)
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        vecPriority.push_back(TxPriority(pdepender->dPriority, pdepender->dFeePerKb, pdepender));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                     }
                 }
+                mapDependers.erase(hash);
             }
         }
 
@@ -4505,7 +6046,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetPoWHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     if (hash > hashTarget)
         return false;
@@ -4550,6 +6091,12 @@ void static LitecoinDarkMiner(CWallet *pwallet)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // Scratch space for the multi-way scrypt kernel, too big for the stack
+    const unsigned int nWay = scrypt_multi_way();
+    std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    std::vector<char> vHeaders(nWay * 80);
+    std::vector<uint256> vHashes(nWay);
+
     try { loop {
         while (vNodes.empty())
             MilliSleep(1000);
@@ -4587,28 +6134,40 @@ void static LitecoinDarkMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         loop
         {
             unsigned int nHashesDone = 0;
+            bool fFound = false;
 
-            uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+            // Hash as many consecutive nonces at once as the scrypt kernel has lanes
             loop
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                for (unsigned int nLane = 0; nLane < nWay; nLane++)
+                {
+                    memcpy(&vHeaders[nLane * 80], BEGIN(pblock->nVersion), 80);
+                    *(unsigned int*)&vHeaders[nLane * 80 + 76] = pblock->nNonce + nLane;
+                }
+                scrypt_1024_1_1_256_multi(&vHeaders[0], BEGIN(vHashes[0]), nWay, &vScratchpad[0]);
 
-                if (thash <= hashTarget)
+                for (unsigned int nLane = 0; nLane < nWay; nLane++)
                 {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
+                    if (vHashes[nLane] <= hashTarget)
+                    {
+                        // Found a solution
+                        pblock->nNonce += nLane;
+                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                        CheckWork(pblock, *pwallet, reservekey);
+                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                        fFound = true;
+                        break;
+                    }
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                if (fFound)
+                    break;
+                pblock->nNonce += nWay;
+                nHashesDone += nWay;
+                if ((pblock->nNonce & 0xFF) < nWay)
                     break;
             }
 
@@ -4659,7 +6218,7 @@ void static LitecoinDarkMiner(CWallet *pwallet)
             {
                 // Changing pblock->nTime can change work required on testnet:
                 nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
         }
     } }
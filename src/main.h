@@ -13,6 +13,9 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -33,6 +36,27 @@ static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/4;         // 250K
 static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 250000;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 17000;
+/** Number of recently verified block headers whose proof of work is remembered */
+static const unsigned int MAX_POW_CACHE_SIZE = 10000;
+/** Largest batch of blocks (by count and by size) a block import pre-checks at once */
+static const unsigned int MAX_PRECHECK_BLOCKS = 256;
+static const unsigned int MAX_PRECHECK_BYTES = 32 * MAX_BLOCK_SIZE;
+/** Maximum number of threads reading files ahead during a block import */
+static const int MAX_IMPORT_SCAN_THREADS = 4;
+/** Number of pre-checked batches read ahead per file during a block import */
+static const unsigned int MAX_IMPORT_QUEUED_BATCHES = 2;
+/** Recently accepted or connected blocks kept in memory with their undo data, for short reorgs */
+static const unsigned int MAX_RECENT_BLOCKS = 12;
+/** Connected blocks waiting for the wallets before validation waits for them */
+static const unsigned int MAX_WALLET_NOTIFY_BLOCKS = 16;
+/** Default for -syncbytes, megabytes of block and undo data written before a batched sync is forced */
+static const unsigned int DEFAULT_SYNC_BYTES = 64;
+/** Blocks deeper than this are sent in full when asked for as compact blocks or their transactions */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+/** Compact blocks waiting for a blocktxn reply */
+static const unsigned int MAX_PENDING_CMPCTBLOCKS = 16;
+/** Seconds a peer has to answer a getblocktxn */
+static const int64 CMPCTBLOCK_TIMEOUT = 60;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
@@ -86,7 +110,10 @@ extern int nBestHeight;
 extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern CBlockIndex* pindexBest;
+extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -102,7 +129,10 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+extern int64 nSyncInterval;
+extern uint64 nSyncBytes;
+extern bool fCompactBlocks;
 
 // Settings
 extern int64 nTransactionFee;
@@ -115,13 +145,16 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
+class CBlockHeader;
 struct CDiskBlockPos;
 class CCoins;
 class CTxUndo;
 class CCoinsView;
 class CCoinsViewCache;
+class CCoinsViewDB;
 class CScriptCheck;
 class CValidationState;
+class CBlockFileMapping;
 
 struct CBlockTemplate;
 
@@ -129,8 +162,14 @@ struct CBlockTemplate;
 void RegisterWallet(CWallet* pwalletIn);
 /** Unregister a wallet from core */
 void UnregisterWallet(CWallet* pwalletIn);
-/** Push an updated transaction to all registered wallets */
+/** Push an updated transaction to all registered wallets, in order with other notifications */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
+/** Push the transactions of a connected block to all registered wallets */
+void SyncWithWallets(const CBlock& block);
+/** Wait until the wallets have seen all notifications queued so far. Not to be called holding cs_wallet. */
+void FlushWalletNotifications();
+/** Run the thread that delivers wallet notifications */
+void ThreadWalletNotify();
 /** Process an incoming block */
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
 /** Check whether enough disk space is available for an incoming block */
@@ -139,8 +178,16 @@ bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
-/** Import blocks from an external file */
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Map a finished block file read-only into memory. Empty for the file still being appended to. */
+boost::shared_ptr<const CBlockFileMapping> MapBlockFile(int nFile);
+/** Find the serialized block stored at pos inside its mapped block file */
+bool GetMappedBlock(const CDiskBlockPos &pos, boost::shared_ptr<const CBlockFileMapping> &mapping, const char *&pchBlock, unsigned int &nBlockSize);
+/** Import blocks from external files, reading several at once but connecting them in order. Closes the files. */
+bool LoadExternalBlockFiles(const std::vector<FILE*>& vFiles);
+/** Rebuild the block index from the first nFiles block files (blk?????.dat), reading several at once */
+bool ReindexBlockFiles(int nFiles);
+/** Replace the coins database with a UTXO snapshot file (see dumptxoutset) if it is ahead of the chain */
+bool LoadTxOutSet(const boost::filesystem::path &path);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -161,8 +208,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadScriptCheck();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
-/** Generate a new block, without valid proof-of-work */
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+/** Generate a new block, without valid proof-of-work. Transactions of
+ *  pblocktemplatePrev that are still valid on the same tip are kept first. */
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, const CBlockTemplate* pblocktemplatePrev = NULL);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -172,12 +220,26 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+/** Check a header's scrypt proof of work, unless the same header was already verified recently */
+bool CheckBlockProofOfWork(const CBlockHeader& block);
+/** Provide header hashes whose proof of work an earlier block tree verified, to be trusted while reindexing */
+void SetReindexProofOfWork(std::vector<uint256>& vHash);
+/** Verify proof of work of headers and merkle roots of blocks about to be processed, in parallel */
+void PreCheckBlocks(const std::vector<CBlockHeader>& vHeaders, const std::vector<const CBlock*>& vpblock);
+/** Run an instance of the block pre-check thread */
+void ThreadBlockPreCheck();
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 /** Get the number of active peers */
 int GetNumBlocksOfPeers();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
+/** Commit a block or undo file write now, or leave it to the next batched sync */
+void CommitBlockWrite(FILE *file, const CDiskBlockPos &pos, unsigned int nSize, bool fUndo);
+/** Commit all block and undo data written so far, and the block index */
+void SyncBlockData();
+/** After an unclean shutdown, check the block and undo data that may not have reached the disk */
+bool CheckUnsyncedBlockData();
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -236,6 +298,23 @@ struct CDiskBlockPos
     bool IsNull() const { return (nFile == -1); }
 };
 
+/** A block file mapped read-only into memory, see MapBlockFile */
+class CBlockFileMapping
+{
+protected:
+    const char *pbegin;
+    size_t nSize;
+
+    CBlockFileMapping() : pbegin(NULL), nSize(0) { }
+
+public:
+    virtual ~CBlockFileMapping() { }
+
+    const char *begin() const { return pbegin; }
+    const char *end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
 struct CDiskTxPos : public CDiskBlockPos
 {
     unsigned int nTxOffset; // after header
@@ -811,8 +890,7 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
+        CommitBlockWrite(fileout, pos, nSize + sizeof(uint256), true);
 
         return true;
     }
@@ -896,6 +974,15 @@ public:
  *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
  *  - height = 120891
  */
+/** Memory malloc really takes for nAlloc bytes: glibc adds a size_t header
+ *  and rounds up to 16 bytes */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    return ((nAlloc + sizeof(size_t) + 15) >> 4) << 4;
+}
+
 class CCoins
 {
 public:
@@ -1092,6 +1179,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory held by the outputs and their scripts
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += MallocUsage(out.scriptPubKey.capacity());
+        return nUsage;
+    }
 };
 
 /** Closure representing one script verification
@@ -1165,6 +1260,9 @@ public:
 
 
     int SetMerkleBranch(const CBlock* pblock=NULL);
+    // Locate the transaction in block and set hashBlock, nIndex and the merkle branch.
+    // Unlike SetMerkleBranch, does not look at the chain, so needs no cs_main.
+    bool SetMerkleBranchFromBlock(const CBlock& block);
 
     // Return depth of transaction in blockchain:
     // -1  : not in blockchain, and not in memory pool (conflicted transaction)
@@ -1333,6 +1431,13 @@ public:
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
+    uint256 GetPoWHash() const
+    {
+        uint256 thash;
+        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+        return thash;
+    }
+
     int64 GetBlockTime() const
     {
         return (int64)nTime;
@@ -1349,6 +1454,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fPreChecked; // vMerkleTree was built by PreCheckBlocks
 
     CBlock()
     {
@@ -1372,13 +1478,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
-    }
-
-    uint256 GetPoWHash() const
-    {
-        uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
-        return thash;
+        fPreChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -1469,8 +1569,7 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
+        CommitBlockWrite(fileout, pos, nSize, false);
 
         return true;
     }
@@ -1479,17 +1578,31 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        boost::shared_ptr<const CBlockFileMapping> mapping;
+        const char *pchBlock;
+        unsigned int nBlockSize;
+        if (GetMappedBlock(pos, mapping, pchBlock, nBlockSize)) {
+            // Finished block files are read straight from their mapping
+            CMemoryReader reader(pchBlock, pchBlock + nBlockSize, SER_DISK, CLIENT_VERSION);
+            try {
+                reader >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        } else {
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1530,8 +1643,9 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // fCheckScripts may be false for a block that was connected before, which checked them.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, bool fCheckScripts=true);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1623,7 +1737,9 @@ enum BlockStatus {
 
     BLOCK_FAILED_VALID       =   32, // stage after last reached validness failed
     BLOCK_FAILED_CHILD       =   64, // descends from failed block
-    BLOCK_FAILED_MASK        =   96
+    BLOCK_FAILED_MASK        =   96,
+
+    BLOCK_VALID_POW          =  128  // scrypt hash satisfies nBits, no need to recompute it
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -1761,18 +1877,24 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative;
+        bool fOverflow;
+        uint256 bnTarget;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+        // as it's too large for a uint256. However, as 2**256 is at least as large
+        // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+        // or ~bnTarget / (bnTarget+1) + 1.
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
     {
-        return (pnext || this == pindexBest);
+        return (nHeight >= 0 && nHeight < (int)vBlockIndexByHeight.size() && vBlockIndexByHeight[nHeight] == this);
     }
 
     bool CheckIndex() const
@@ -2105,13 +2227,78 @@ public:
 
 
 
+/** What CreateNewBlock needs to know about a memory pool transaction, worked
+ * out once instead of on every call.
+ */
+class CTxMemPoolEntry
+{
+public:
+    const CTransaction* ptx;
+    uint256 hash;
+    unsigned int nTxSize;
+    double dFeePerKb;
+    double dPriority;                     // as of CTxMemPool::nPriorityHeight
+    double dChainValueIn;                 // sum of input values already in the chain
+    double dChainValueHeight;             // sum of those values times the height they confirmed at
+    std::set<uint256> setMemPoolParents;  // memory pool transactions this one spends
+    bool fIndexed;                        // in setByPriority and setByFeeRate
+
+    CTxMemPoolEntry()
+    {
+        ptx = NULL;
+        hash = 0;
+        nTxSize = 0;
+        dFeePerKb = dPriority = dChainValueIn = dChainValueHeight = 0;
+        fIndexed = false;
+    }
+
+    double GetPriority(int nHeight) const
+    {
+        // sum(valuein * (nHeight - heightin + 1)) / txsize
+        return (dChainValueIn * (nHeight + 1) - dChainValueHeight) / nTxSize;
+    }
+};
+
+/** Orders memory pool entries the way blocks are filled: by priority then fee
+ * rate, or by fee rate then priority. Ties are broken by txid.
+ */
+class CTxMemPoolEntryCompare
+{
+    bool fByFee;
+public:
+    CTxMemPoolEntryCompare(bool fByFeeIn = false) : fByFee(fByFeeIn) { }
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double a1 = fByFee ? a->dFeePerKb : a->dPriority, a2 = fByFee ? a->dPriority : a->dFeePerKb;
+        double b1 = fByFee ? b->dFeePerKb : b->dPriority, b2 = fByFee ? b->dPriority : b->dFeePerKb;
+        if (a1 != b1)
+            return a1 < b1;
+        if (a2 != b2)
+            return a2 < b2;
+        return a->hash < b->hash;
+    }
+};
+
 class CTxMemPool
 {
 public:
+    typedef std::set<const CTxMemPoolEntry*, CTxMemPoolEntryCompare> indexed_entries;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Block template indexes. Entries in setStale still need their inputs
+    // looked up; updateIndexes() does that and re-sorts by priority once the
+    // chain has grown.
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<uint256> setStale;
+    indexed_entries setByPriority;
+    indexed_entries setByFeeRate;
+    int nPriorityHeight;
+
+    CTxMemPool() : setByPriority(CTxMemPoolEntryCompare(false)), setByFeeRate(CTxMemPoolEntryCompare(true)), nPriorityHeight(-1) { }
+
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
@@ -2119,6 +2306,13 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    void updateIndexes(int nHeight, CCoinsViewCache &view);
+
+private:
+    void unindexEntry(CTxMemPoolEntry &entry);
+    void markStale(const uint256& hash);
+    void markChildrenStale(const uint256& hash);
+public:
 
     unsigned long size()
     {
@@ -2139,6 +2333,53 @@ public:
 
 extern CTxMemPool mempool;
 
+/** Stages of checking and connecting a block, timed for getconnectstats */
+enum BlockConnectStage
+{
+    CONNECT_POW,        // proof of work, in CheckBlock
+    CONNECT_CHECKBLOCK, // the rest of CheckBlock
+    CONNECT_INPUTS,     // fetching inputs, queueing their script checks and updating coins
+    CONNECT_SCRIPTS,    // waiting for the script check threads
+    CONNECT_UNDO,       // writing undo data
+    CONNECT_INDEX,      // writing the block and transaction index
+    CONNECT_WALLET,     // wallet notifications
+    CONNECT_TOTAL,      // all of ConnectBlock
+    CONNECT_FLUSH,      // coins flush after SetBestChain connected its blocks, to disk when due
+
+    CONNECT_STAGES
+};
+
+/** Percentiles of one stage over the window, in microseconds */
+struct CConnectStageStats
+{
+    uint64 nCount;        // samples ever taken
+    unsigned int nWindow; // samples these figures are over
+    int64 nMean, nMin, nMedian, n90th, n99th, nMax;
+
+    CConnectStageStats() : nCount(0), nWindow(0), nMean(0), nMin(0), nMedian(0), n90th(0), n99th(0), nMax(0) {}
+};
+
+/** Durations of the last nWindow blocks through each connect stage */
+class CConnectTimings
+{
+private:
+    mutable CCriticalSection cs;
+    unsigned int nWindow;
+    std::vector<int64> vSamples[CONNECT_STAGES]; // ring buffers
+    uint64 nCount[CONNECT_STAGES];
+
+public:
+    CConnectTimings(unsigned int nWindowIn);
+    void Add(BlockConnectStage stage, int64 nMicros);
+    void Get(BlockConnectStage stage, CConnectStageStats &stats) const;
+    static const char *GetStageName(BlockConnectStage stage);
+};
+
+/** Samples per stage kept for getconnectstats */
+static const unsigned int CONNECT_TIMINGS_WINDOW = 1000;
+
+extern CConnectTimings connecttimings;
+
 struct CCoinsStats
 {
     int nHeight;
@@ -2152,6 +2393,43 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** A CCoins in a CCoinsViewCache, with what the cache knows about its parent */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char nFlags;
+
+    enum Flags {
+        DIRTY = (1 << 0), // may differ from the parent's version, has to be written on flush
+        FRESH = (1 << 1), // the parent has no unspent version, so a pruned entry need not be written
+    };
+
+    CCoinsCacheEntry() : coins(), nFlags(0) {}
+};
+
+/** Hashes txids for the coins cache. The salt is random, so transaction ids
+ *  can't be ground to pile up in one bucket. */
+class CCoinsKeyHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CCoinsKeyHasher();
+
+    size_t operator()(const uint256 &key) const {
+        uint64 h = k0;
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ key.Get64(i)) * 0x9e3779b97f4a7c15ULL;
+            h ^= (h >> 29) + k1;
+        }
+        return h;
+    }
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+                             pooled_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2172,8 +2450,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (the DIRTY entries of mapCoins + one SetBestBlock).
+    // Entries are moved out of mapCoins, which is left empty.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2196,19 +2475,46 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
+class CCoinsViewCache;
+
+/** Modifiable reference to a CCoins in a CCoinsViewCache. When it goes out
+ *  of scope the cache accounts for the memory the change took or freed, and
+ *  forgets a FRESH entry that ended up fully spent. Only one can exist per
+ *  cache at a time, and nothing else may be fetched into the cache meanwhile. */
+class CCoinsModifier
+{
+private:
+    CCoinsViewCache &cache;
+    CCoinsMap::iterator it;
+    size_t nUsageBefore;
+
+    CCoinsModifier(CCoinsViewCache &cacheIn, CCoinsMap::iterator itIn, size_t nUsageBeforeIn);
+
+public:
+    CCoins *operator->() { return &it->second.coins; }
+    CCoins &operator*() { return it->second.coins; }
+    ~CCoinsModifier();
+
+    friend class CCoinsViewCache;
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+    // heap memory of the CCoins in cacheCoins
+    size_t nCachedCoinsUsage;
+    bool fHasModifier;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
+    ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
@@ -2216,12 +2522,22 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
-    // Return a modifiable reference to a CCoins. Check HaveCoins first.
+    // Return a reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
     // copying.
-    CCoins &GetCoins(const uint256 &txid);
+    const CCoins &GetCoins(const uint256 &txid);
+
+    // Return a modifiable reference to a CCoins, fetching it from the base
+    // first. Marks the entry DIRTY.
+    CCoinsModifier ModifyCoins(const uint256 &txid);
+
+    // Like ModifyCoins, for the outputs of a transaction being added. The
+    // caller guarantees the base has no unspent version of txid (ConnectBlock
+    // enforces BIP30), so nothing is looked up and, if spent again before the
+    // next Flush, the entry never reaches the base.
+    CCoinsModifier ModifyNewCoins(const uint256 &txid);
 
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
@@ -2230,8 +2546,13 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage() const;
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+
+    friend class CCoinsModifier;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2247,6 +2568,9 @@ public:
     bool HaveCoins(const uint256 &txid);
 };
 
+/** Global variable that points to the coins database below pcoinsTip */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -2295,4 +2619,128 @@ public:
     )
 };
 
+
+
+/** A transaction sent in full as part of a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Used to relay new blocks as the header and a 6 byte id per transaction,
+ * which the receiver looks up in its memory pool. The ids are salted with the
+ * block and a nonce of the sender's, so nobody can make them collide on
+ * purpose ahead of time.
+ */
+class CCompactBlock
+{
+public:
+    CBlockHeader header;
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIDs; // the transactions not prefilled, in block order
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    // Create from a CBlock, sending the coinbase in full
+    CCompactBlock(const CBlock& block);
+
+    unsigned int GetTransactionCount() const
+    {
+        return vShortTxIDs.size() + vPrefilledTxn.size();
+    }
+
+    uint256 GetShortTxIDKey() const;
+    static uint64 GetShortTxID(const uint256& hashKey, const uint256& txhash);
+
+    IMPLEMENT_SERIALIZE
+    (
+        CCompactBlock* pthis = const_cast<CCompactBlock*>(this);
+        READWRITE(header);
+        READWRITE(nNonce);
+        unsigned int nShortTxIDs = vShortTxIDs.size();
+        READWRITE(VARINT(nShortTxIDs));
+        if (fRead)
+        {
+            if (nShortTxIDs > MAX_BLOCK_SIZE / 60)
+                throw std::ios_base::failure("CCompactBlock : too many short ids");
+            pthis->vShortTxIDs.resize(nShortTxIDs);
+        }
+        for (unsigned int i = 0; i < nShortTxIDs; i++)
+        {
+            unsigned int nLow = vShortTxIDs[i] & 0xffffffff;
+            unsigned short nHigh = vShortTxIDs[i] >> 32;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                pthis->vShortTxIDs[i] = ((uint64)nHigh << 32) | nLow;
+        }
+        READWRITE(vPrefilledTxn);
+    )
+};
+
+/** A block being put together from a compact block: the memory pool, then
+ * a blocktxn reply for what it lacked.
+ */
+class CPartialBlock
+{
+public:
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+    // Fill in the prefilled transactions and those the memory pool has. False
+    // if the compact block is malformed, or two of its ids are the same.
+    bool Init(const CCompactBlock& cmpctblock, CTxMemPool& pool);
+
+    // Positions of the transactions still to be asked for
+    std::vector<unsigned int> GetMissing() const;
+
+    // Fill in the transactions asked for, in the order GetMissing() gave
+    bool FillMissing(const std::vector<CTransaction>& vtxMissing);
+
+    // The block, once nothing is missing. False if a short id matched the
+    // wrong transaction, so that the merkle root differs.
+    bool GetBlock(CBlock& block) const;
+};
+
+/** getblocktxn: transactions of a compact block the receiver lacks */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** blocktxn: the reply to a getblocktxn */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
 #endif
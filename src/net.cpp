@@ -53,9 +53,59 @@ static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
 
+// Buffers of sent messages, kept for the next messages so that building one
+// rarely allocates. Defined before anything holding send buffers, so that it
+// outlives them at exit; buffers released after it are simply freed.
+static const unsigned int MAX_POOLED_SEND_BUFFERS = 1024;
+static const size_t MAX_POOLED_SEND_BUFFER_SIZE = 64 * 1024;
+static bool fSendBufferPoolDestroyed = false;
+
+class CSendBufferPool
+{
+private:
+    boost::mutex mutex;
+    std::vector<CSerializeData*> vFree;
+
+public:
+    CSerializeData* Get()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!vFree.empty()) {
+                CSerializeData* pdata = vFree.back();
+                vFree.pop_back();
+                return pdata;
+            }
+        }
+        return new CSerializeData();
+    }
+
+    void Put(CSerializeData* pdata)
+    {
+        // Large ones, such as blocks, are rare enough to allocate each time
+        if (pdata->capacity() <= MAX_POOLED_SEND_BUFFER_SIZE) {
+            pdata->clear();
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vFree.size() < MAX_POOLED_SEND_BUFFERS) {
+                vFree.push_back(pdata);
+                return;
+            }
+        }
+        delete pdata;
+    }
+
+    ~CSendBufferPool()
+    {
+        fSendBufferPoolDestroyed = true;
+        BOOST_FOREACH(CSerializeData* pdata, vFree)
+            delete pdata;
+    }
+};
+static CSendBufferPool sendbufferpool;
+
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSendBufferRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -71,6 +121,91 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+// Peers with complete messages or getdata to answer, waiting for a message
+// handler thread. A queued or busy node holds no reference: it is taken out
+// of the queue before deletion, and not deleted while busy.
+static boost::mutex mutexNodesReady;
+static boost::condition_variable condNodesReady;
+static deque<CNode*> vNodesReady;
+static int64 nNextSendPass = 0;
+
+#ifdef USE_EPOLL
+// Socket readiness of the network thread
+static CSocketEvents *psocketevents = NULL;
+// Set when the network thread stopped reading a socket because its receive buffer is full
+static bool fRecvPaused = false;
+// Tags the listening sockets' events
+static char chListenSocket;
+#endif
+
+void static WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (psocketevents)
+        psocketevents->Wake();
+#endif
+}
+
+// Queue pnode for the message handlers; the caller must hold a reference. A
+// busy node is queued once its thread releases it, which keeps its messages
+// in order.
+void static MarkNodeReady(CNode *pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexNodesReady);
+        if (pnode->fMessageReady)
+            return;
+        pnode->fMessageReady = true;
+        if (pnode->fMessageBusy)
+            return;
+        vNodesReady.push_back(pnode);
+    }
+    condNodesReady.notify_one();
+}
+
+// Take pnode for this message handler thread, unless another one has it
+bool static ClaimNode(CNode *pnode)
+{
+    boost::unique_lock<boost::mutex> lock(mutexNodesReady);
+    if (pnode->fMessageBusy)
+        return false;
+    pnode->fMessageBusy = true;
+    if (pnode->fMessageReady)
+    {
+        pnode->fMessageReady = false;
+        vNodesReady.erase(remove(vNodesReady.begin(), vNodesReady.end(), pnode), vNodesReady.end());
+    }
+    return true;
+}
+
+void static ReleaseNode(CNode *pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexNodesReady);
+        pnode->fMessageBusy = false;
+        if (!pnode->fMessageReady)
+            return;
+        vNodesReady.push_back(pnode);
+    }
+    condNodesReady.notify_one();
+}
+
+// Whether the message handler has more to do for pnode; requires LOCK(cs_vRecvMsg)
+bool static HasMessageWork(CNode *pnode)
+{
+    return !pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
+}
+
+// Queue pnode again once a full send buffer it waits on has drained
+void static CheckWaitingForSend(CNode *pnode)
+{
+    if (pnode->fWaitingForSend && pnode->nSendSize < SendBufferSize())
+    {
+        pnode->fWaitingForSend = false;
+        MarkNodeReady(pnode);
+    }
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -483,6 +618,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -499,6 +635,10 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+#ifdef USE_EPOLL
+        if (fSocketRegistered && psocketevents)
+            psocketevents->Remove(hSocket);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -685,24 +825,91 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
+static void ReleaseSendBuffer(CSerializeData* pdata)
+{
+    if (fSendBufferPoolDestroyed)
+        delete pdata;
+    else
+        sendbufferpool.Put(pdata);
+}
+
+void FinishMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+CSendBufferRef TakeSendBuffer(CDataStream& ss)
+{
+    CSerializeData* pdata = sendbufferpool.Get();
+    ss.GetAndClear(*pdata);
+    return CSendBufferRef(pdata, ReleaseSendBuffer);
+}
+
+CSendBufferRef MakeSendBuffer(const char* pszCommand, const char* pch, size_t nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + nSize);
+    ss << CMessageHeader(pszCommand, 0);
+    ss.write(pch, nSize);
+    FinishMessageHeader(ss);
+    return TakeSendBuffer(ss);
+}
+
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBufferRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        size_t nToSend = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the kernel as many queued messages as it takes in one call
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nToSend = 0;
+        for (std::deque<CSendBufferRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; itIov++, nIov++) {
+            size_t nOffset = (itIov == it ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nToSend += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
+                pnode->fSocketWritable = false;
                 break;
             }
         } else {
@@ -714,6 +921,8 @@ void SocketSendData(CNode *pnode)
                     printf("socket send error %d\n", nErr);
                     pnode->CloseSocketDisconnect();
                 }
+                else if (nErr == WSAEWOULDBLOCK)
+                    pnode->fSocketWritable = false;
             }
             // couldn't send anything at all
             break;
@@ -729,75 +938,436 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef USE_EPOLL
+CSocketEvents::CSocketEvents()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    fdWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd != -1 && fdWakeup != -1) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdWakeup, &ev) == 0)
+            return;
+    }
+    printf("CSocketEvents() : epoll unavailable, error %d\n", errno);
+    Close();
+}
+
+CSocketEvents::~CSocketEvents()
+{
+    Close();
+}
+
+void CSocketEvents::Close()
+{
+    if (epfd != -1)
+        close(epfd);
+    if (fdWakeup != -1)
+        close(fdWakeup);
+    epfd = fdWakeup = -1;
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void *p)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, hSocket, &ev) == 0)
+        return true;
+    // A socket number closed elsewhere without Remove() and reused since
+    return errno == EEXIST && epoll_ctl(epfd, EPOLL_CTL_MOD, hSocket, &ev) == 0;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+    // Closing a socket only leaves the set once no forked child holds it anymore
+    struct epoll_event ev;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, hSocket, &ev);
+}
+
+bool CSocketEvents::Wait(std::vector<std::pair<void*, int> > &vEvents, int nTimeout)
+{
+    vEvents.clear();
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(epfd, events, MAX_SOCKET_EVENTS, nTimeout);
+    if (nEvents < 0)
+        return errno == EINTR;
+    for (int i = 0; i < nEvents; i++) {
+        if (events[i].data.ptr == NULL) {
+            uint64_t nCount;
+            if (read(fdWakeup, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                printf("CSocketEvents::Wait() : wakeup read error %d\n", errno);
+            continue;
+        }
+        int nFlags = 0;
+        if (events[i].events & EPOLLIN)
+            nFlags |= EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            nFlags |= EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            nFlags |= EVENT_ERROR;
+        void *p = events[i].data.ptr;
+        vEvents.push_back(make_pair(p, nFlags));
+    }
+    return true;
+}
+
+void CSocketEvents::Wake()
+{
+    uint64_t nOne = 1;
+    if (write(fdWakeup, &nOne, sizeof(nOne)) < 0 && errno != EAGAIN)
+        printf("CSocketEvents::Wake() : write error %d\n", errno);
+}
+#endif
+
+void static DisconnectNodes(unsigned int &nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    loop
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    boost::unique_lock<boost::mutex> lock(mutexNodesReady);
+                    // a message handler thread may have just taken it off the queue
+                    if (!pnode->fMessageBusy)
                     {
+                        if (pnode->fMessageReady)
+                            vNodesReady.erase(remove(vNodesReady.begin(), vNodesReady.end(), pnode), vNodesReady.end());
                         vNodesDisconnected.remove(pnode);
                         delete pnode;
                     }
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount)
+    }
+    if (vNodes.size() != nPrevNodeCount)
+    {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+    }
+}
+
+// Accept one connection; false once there is none waiting
+bool static AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+    return true;
+}
+
+// Whether pnode has room for more received data; requires LOCK(cs_vRecvMsg)
+bool static WantsReceive(CNode *pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+// Read once from pnode's socket; false when nothing more can be read for now.
+// Requires LOCK(cs_vRecvMsg).
+bool static ReceiveSocketData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+            MarkNodeReady(pnode);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+        return nErr == WSAEINTR;
+    }
+    return false;
+}
+
+void static CheckInactivity(CNode *pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// Sockets are added to the event set once, and serviced as soon as the kernel
+// reports them ready. Readiness is remembered per node until a recv or send
+// would block, so nothing is lost to the edge-triggered reporting.
+void static ThreadSocketHandlerEpoll(CSocketEvents &events)
+{
+    unsigned int nPrevNodeCount = 0;
+    int64 nLastInactivityCheck = 0;
+    int nTimeout = 0;
+    vector<pair<void*, int> > vEvents;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && !events.Add(hListenSocket, &chListenSocket))
+            printf("socket epoll add failed for listening socket: %d\n", errno);
+
+    loop
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
+                pnode->AddRef();
+                if (!pnode->fSocketRegistered && pnode->hSocket != INVALID_SOCKET)
+                {
+                    pnode->fSocketRegistered = true;
+                    if (!events.Add(pnode->hSocket, pnode))
+                    {
+                        printf("socket epoll add failed: %d\n", errno);
+                        pnode->CloseSocketDisconnect();
+                    }
+                }
+            }
+        }
+
+        if (!events.Wait(vEvents, nTimeout))
+        {
+            printf("socket epoll error %d\n", errno);
+            MilliSleep(50);
+        }
+        boost::this_thread::interruption_point();
+
+        // A node reported here is still alive: nodes are only deleted by this
+        // thread, after their socket left the set.
+        bool fAccept = false;
+        BOOST_FOREACH(const PAIRTYPE(void*, int)& event, vEvents)
         {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+            if (event.first == &chListenSocket)
+            {
+                fAccept = true;
+                continue;
+            }
+            CNode* pnode = (CNode*)event.first;
+            if (event.second & (CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERROR))
+                pnode->fSocketReadable = true;
+            if (event.second & CSocketEvents::EVENT_SEND)
+            {
+                LOCK(pnode->cs_vSend);
+                pnode->fSocketWritable = true;
+            }
         }
 
+        // Frequency to check for timeouts and disconnects when nothing happens
+        nTimeout = 50;
+
+        if (fAccept)
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                    nTimeout = 0; // register the new sockets right away
+        }
+
+        bool fCheckInactivity = GetTime() != nLastInactivityCheck;
+        nLastInactivityCheck = GetTime();
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            boost::this_thread::interruption_point();
+
+            //
+            // Send, before receiving more (see the select() loop below)
+            //
+            if (pnode->fSocketWritable && pnode->nSendSize > 0 && pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    if (pnode->fSocketWritable)
+                    {
+                        SocketSendData(pnode);
+                        CheckWaitingForSend(pnode);
+                    }
+                }
+                else
+                    nTimeout = min(nTimeout, 1);
+            }
+
+            //
+            // Receive
+            //
+            if (pnode->fSocketReadable && pnode->nSendSize == 0 && pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                {
+                    while (pnode->fSocketReadable && WantsReceive(pnode))
+                        pnode->fSocketReadable = ReceiveSocketData(pnode);
+                    if (pnode->fSocketReadable)
+                        fRecvPaused = true;
+                }
+                else
+                    nTimeout = min(nTimeout, 1);
+            }
+
+            //
+            // Inactivity checking
+            //
+            if (fCheckInactivity)
+                CheckInactivity(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (psocketevents)
+    {
+        ThreadSocketHandlerEpoll(*psocketevents);
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
+
 
         //
         // Find which sockets have data to receive
@@ -854,9 +1424,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && WantsReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -886,58 +1454,7 @@ void ThreadSocketHandler()
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            AcceptConnection(hListenSocket);
 
 
         //
@@ -963,38 +1480,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    ReceiveSocketData(pnode);
             }
 
             //
@@ -1006,32 +1492,16 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+                    CheckWaitingForSend(pnode);
+                }
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            CheckInactivity(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1508,75 +1978,124 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Process pnode's messages and send it what is due; the caller must have it claimed
+void static ProcessNode(CNode* pnode, bool fSendTrickle)
 {
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
-    {
-        bool fHaveSyncNode = false;
+    if (pnode->fDisconnect)
+        return;
 
-        vector<CNode*> vNodesCopy;
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
+            if (!ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            // Come back after the other ready peers had their turn, or
+            // once the network thread made room to send the replies
+            if (HasMessageWork(pnode))
+            {
+                if (pnode->nSendSize < SendBufferSize())
+                    MarkNodeReady(pnode);
+                else
+                    pnode->fWaitingForSend = true;
             }
         }
+        else
+            MarkNodeReady(pnode);
+    }
+    boost::this_thread::interruption_point();
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode, fSendTrickle);
+    }
+    boost::this_thread::interruption_point();
+}
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+// Visit all peers, for what SendMessages() does on its own: trickling, pings
+// and relaying. Peers another thread is working on are left to the next pass.
+void static ProcessAllNodes()
+{
+    bool fHaveSyncNode = false;
 
-        bool fSleep = true;
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            pnode->AddRef();
+            if (pnode == pnodeSync)
+                fHaveSyncNode = true;
+        }
+    }
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            if (pnode->fDisconnect)
-                continue;
+    if (!fHaveSyncNode)
+        StartSync(vNodesCopy);
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+    CNode* pnodeTrickle = NULL;
+    if (!vNodesCopy.empty())
+        pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (ClaimNode(pnode))
+        {
+            ProcessNode(pnode, pnode == pnodeTrickle);
+            ReleaseNode(pnode);
+        }
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
 
-            // Send messages
+// Several of these threads run at once, each working on one peer at a time.
+// A peer is processed as soon as the network thread queues it; every
+// MESSAGE_HANDLER_SEND_INTERVAL one of the threads also visits all peers.
+void ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexNodesReady);
+            while (vNodesReady.empty() && GetTimeMillis() < nNextSendPass)
+                condNodesReady.timed_wait(lock, boost::posix_time::milliseconds(nNextSendPass - GetTimeMillis()));
+            if (GetTimeMillis() < nNextSendPass)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                pnode = vNodesReady.front();
+                vNodesReady.pop_front();
+                pnode->fMessageReady = false;
+                pnode->fMessageBusy = true;
             }
-            boost::this_thread::interruption_point();
+            else
+                nNextSendPass = GetTimeMillis() + MESSAGE_HANDLER_SEND_INTERVAL;
         }
 
+        if (pnode)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            ProcessNode(pnode, false);
+            ReleaseNode(pnode);
         }
+        else
+            ProcessAllNodes();
 
-        if (fSleep)
-            MilliSleep(100);
+#ifdef USE_EPOLL
+        // Buffers were drained, the network thread can read the paused sockets again
+        if (fRecvPaused)
+        {
+            fRecvPaused = false;
+            WakeSocketHandler();
+        }
+#endif
     }
 }
 
@@ -1740,6 +2259,23 @@ void static Discover()
         NewThread(ThreadGetMyExternalIP, NULL);
 }
 
+bool InitSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (psocketevents == NULL && GetBoolArg("-epoll", true)) {
+        psocketevents = new CSocketEvents();
+        if (!psocketevents->IsValid()) {
+            delete psocketevents;
+            psocketevents = NULL;
+        }
+    }
+    printf("Using %s for network sockets\n", psocketevents ? "epoll" : "select");
+    return psocketevents != NULL;
+#else
+    return false;
+#endif
+}
+
 void StartNode(boost::thread_group& threadGroup)
 {
     if (semOutbound == NULL) {
@@ -1777,7 +2313,12 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlers = GetArg("-msghandlers", 0);
+    if (nMessageHandlers <= 0)
+        nMessageHandlers += boost::thread::hardware_concurrency();
+    nMessageHandlers = std::max(1, std::min(nMessageHandlers, MAX_MESSAGE_HANDLERS));
+    for (int i = 0; i < nMessageHandlers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1824,6 +2365,10 @@ public:
         vNodesDisconnected.clear();
         delete semOutbound;
         semOutbound = NULL;
+#ifdef USE_EPOLL
+        delete psocketevents;
+        psocketevents = NULL;
+#endif
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
@@ -1861,8 +2406,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved.
+        // It is built once, every peer asking for it is sent the same buffer.
+        mapRelay.insert(std::make_pair(inv, MakeSendBuffer(inv.GetCommand(), &ss[0], ss.size())));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
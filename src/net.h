@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -29,8 +30,18 @@ extern int nBestHeight;
 
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLERS = 16;
+/** Milliseconds between the message handler's passes over all peers, for sending */
+static const int64 MESSAGE_HANDLER_SEND_INTERVAL = 100;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Maximum number of queued messages handed to the kernel in one send call */
+static const int MAX_SEND_IOV = 64;
+
+/** A complete message as it goes on the wire, header included. It is never
+ *  changed once built, so the send queues of any number of peers can share it. */
+typedef boost::shared_ptr<const CSerializeData> CSendBufferRef;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -45,9 +56,52 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+/** Set up epoll for the network threads; false if select() will be used */
+bool InitSocketEvents();
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Fill in the payload size and checksum of the message in ss, which starts with its header */
+void FinishMessageHeader(CDataStream& ss);
+/** Move the finished message in ss to a buffer from the send buffer pool */
+CSendBufferRef TakeSendBuffer(CDataStream& ss);
+/** Build a message around a payload that is already serialized, to push to any number of peers */
+CSendBufferRef MakeSendBuffer(const char* pszCommand, const char* pch, size_t nSize);
+
+#ifdef USE_EPOLL
+/** Maximum number of socket events taken from the kernel per wait */
+static const int MAX_SOCKET_EVENTS = 256;
+
+/** Edge-triggered socket readiness through epoll. Sockets are added once and
+ *  leave the set when closed; Wake() interrupts a Wait() from another thread. */
+class CSocketEvents
+{
+private:
+    int epfd;
+    int fdWakeup;
+
+    void Close();
+
+public:
+    enum
+    {
+        EVENT_RECV  = (1 << 0),
+        EVENT_SEND  = (1 << 1),
+        EVENT_ERROR = (1 << 2),
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    bool IsValid() const { return epfd != -1; }
+    // Report readiness changes of hSocket tagged with p, which must not be NULL
+    bool Add(SOCKET hSocket, void *p);
+    void Remove(SOCKET hSocket);
+    // Wait up to nTimeout milliseconds, filling vEvents with (tag, EVENT_* flags)
+    bool Wait(std::vector<std::pair<void*, int> > &vEvents, int nTimeout);
+    void Wake();
+};
+#endif
 
 enum
 {
@@ -82,7 +136,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSendBufferRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -126,11 +180,14 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    bool fPreChecked;               // already seen by the block pre-check look-ahead
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        fPreChecked = false;
     }
 
     bool complete() const
@@ -165,15 +222,26 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBufferRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Protected by the message handlers' queue mutex: waiting for a handler
+    // thread, and being worked on by one (a peer has at most one at a time)
+    bool fMessageReady;
+    bool fMessageBusy;
+    bool fWaitingForSend; // message processing waits for the send buffer to drain
     uint64 nRecvBytes;
     int nRecvVersion;
 
+    // Readiness reported by the socket thread's edge-triggered events, kept
+    // until a recv or send would block. fSocketWritable is protected by cs_vSend.
+    bool fSocketRegistered;
+    bool fSocketReadable;
+    bool fSocketWritable;
+
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
@@ -221,6 +289,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend; // also protects setAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -234,6 +303,12 @@ public:
     {
         nServices = 0;
         hSocket = hSocketIn;
+        fSocketRegistered = false;
+        fMessageReady = false;
+        fMessageBusy = false;
+        fWaitingForSend = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
         nRecvVersion = INIT_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
@@ -329,6 +404,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -337,6 +413,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -427,30 +504,35 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        FinishMessageHeader(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", (int)(ssSend.size() - CMessageHeader::HEADER_SIZE));
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        QueueSendBuffer(TakeSendBuffer(ssSend));
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // Requires cs_vSend
+    void QueueSendBuffer(const CSendBufferRef& buffer)
+    {
+        vSendMsg.push_back(buffer);
+        nSendSize += buffer->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Push a message built once for several peers, by MakeSendBuffer()
+    void PushSendBuffer(const CSendBufferRef& buffer)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: shared message (%"PRIszu" bytes)\n", buffer->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendBuffer(buffer);
     }
 
     void PushVersion();
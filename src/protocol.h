@@ -143,6 +143,9 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Asks for a new block as a "cmpctblock", from peers of COMPACT_BLOCKS_VERSION
+    // or later. Like MSG_FILTERED_BLOCK, only for getdata.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
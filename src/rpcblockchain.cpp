@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -193,8 +194,26 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
 
     Object ret;
 
-    CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
+    // One scan at a time; callers that waited for it reuse its result. The
+    // scan reads a database snapshot, so cs_main is only held to flush.
+    static boost::mutex mutexStats;
+    static CCoinsStats statsCached;
+    boost::unique_lock<boost::mutex> lock(mutexStats);
+    bool fScan;
+    {
+        LOCK(cs_main);
+        fScan = statsCached.hashBlock != hashBestChain;
+        if (fScan)
+            pcoinsTip->Flush();
+    }
+    if (fScan) {
+        CCoinsStats statsNew;
+        if (pcoinsTip->GetStats(statsNew))
+            statsCached = statsNew;
+    }
+
+    const CCoinsStats &stats = statsCached;
+    if (stats.hashBlock != 0) {
         ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
@@ -206,6 +225,75 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset <file>\n"
+            "Writes the unspent transaction output set to <file> (relative to the data directory),\n"
+            "for other nodes to start from with -loadtxoutset.");
+
+    boost::filesystem::path path = GetDataDir() / params[0].get_str();
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+
+    {
+        LOCK(cs_main);
+        pcoinsTip->Flush();
+    }
+
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + pathTmp.string());
+    CCoinsStats stats;
+    bool fOk = pcoinsdbview->WriteTxOutSet(fileout, stats);
+    if (fOk) {
+        fflush(fileout);
+        FileCommit(fileout);
+    }
+    fileout.fclose();
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        throw JSONRPCError(RPC_MISC_ERROR, "Writing " + path.string() + " failed");
+    }
+
+    Object ret;
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    return ret;
+}
+
+Value getconnectstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getconnectstats\n"
+            "Returns how long checking and connecting blocks took, per stage, in milliseconds\n"
+            "over the last " + strprintf("%u", CONNECT_TIMINGS_WINDOW) + " samples of each.");
+
+    Object ret;
+    for (int i = 0; i < CONNECT_STAGES; i++)
+    {
+        CConnectStageStats stats;
+        connecttimings.Get((BlockConnectStage)i, stats);
+        Object obj;
+        obj.push_back(Pair("count", (boost::uint64_t)stats.nCount));
+        obj.push_back(Pair("window", (int)stats.nWindow));
+        obj.push_back(Pair("mean", 0.001 * stats.nMean));
+        obj.push_back(Pair("min", 0.001 * stats.nMin));
+        obj.push_back(Pair("median", 0.001 * stats.nMedian));
+        obj.push_back(Pair("90th", 0.001 * stats.n90th));
+        obj.push_back(Pair("99th", 0.001 * stats.n99th));
+        obj.push_back(Pair("max", 0.001 * stats.nMax));
+        ret.push_back(Pair(CConnectTimings::GetStageName((BlockConnectStage)i), obj));
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
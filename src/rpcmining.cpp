@@ -77,14 +77,114 @@ void InitRPCMining()
     pMiningKey = new CReserveKey(pwalletMain);
 }
 
+// Block template shared by getwork, getworkex and getblocktemplate. When
+// only the memory pool changed it is made from the previous one, keeping
+// what is still valid, and the transaction list getblocktemplate returns
+// is serialized once per template instead of once per call.
+static CCriticalSection cs_blocktemplate;
+static CBlockTemplate* pblocktemplateShared = NULL;
+static CBlockIndex* pindexPrevShared = NULL;
+static unsigned int nTransactionsUpdatedShared = 0;
+static int64 nTimeShared = 0;
+static Array arrTransactionsShared;
+
 void ShutdownRPCMining()
 {
+    {
+        LOCK(cs_blocktemplate);
+        delete pblocktemplateShared; pblocktemplateShared = NULL;
+        pindexPrevShared = NULL;
+        arrTransactionsShared.clear();
+    }
+
     if (!pMiningKey)
         return;
 
     delete pMiningKey; pMiningKey = NULL;
 }
 
+// getblocktemplate's "transactions" entries for a template
+static Array BlockTemplateTransactions(const CBlockTemplate& blocktemplate)
+{
+    Array transactions;
+    map<uint256, int64_t> setTxIndex;
+    int i = 0;
+    BOOST_FOREACH (const CTransaction& tx, blocktemplate.block.vtx)
+    {
+        uint256 txHash = tx.GetHash();
+        setTxIndex[txHash] = i++;
+
+        if (tx.IsCoinBase())
+            continue;
+
+        Object entry;
+
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+
+        entry.push_back(Pair("hash", txHash.GetHex()));
+
+        Array deps;
+        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        {
+            if (setTxIndex.count(in.prevout.hash))
+                deps.push_back(setTxIndex[in.prevout.hash]);
+        }
+        entry.push_back(Pair("depends", deps));
+
+        int index_in_template = i - 1;
+        entry.push_back(Pair("fee", blocktemplate.vTxFees[index_in_template]));
+        entry.push_back(Pair("sigops", blocktemplate.vTxSigOps[index_in_template]));
+
+        transactions.push_back(entry);
+    }
+    return transactions;
+}
+
+// Make the shared template current: a new tip always replaces it, memory
+// pool changes only once it is older than nMaxAge seconds.
+// Requires cs_main and cs_blocktemplate.
+static void UpdateSharedBlockTemplate(int64 nMaxAge)
+{
+    if (pblocktemplateShared && pindexPrevShared == pindexBest &&
+        (nTransactionsUpdated == nTransactionsUpdatedShared || GetTime() - nTimeShared <= nMaxAge))
+        return;
+
+    // Store the pindexBest used before CreateNewBlock, to avoid races
+    unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+    CBlockIndex* pindexPrevNew = pindexBest;
+
+    CScript scriptDummy = CScript() << OP_TRUE;
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptDummy, pindexPrevShared == pindexPrevNew ? pblocktemplateShared : NULL);
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+    // Need to update only after we know CreateNewBlock succeeded
+    delete pblocktemplateShared;
+    pblocktemplateShared = pblocktemplate;
+    pindexPrevShared = pindexPrevNew;
+    nTransactionsUpdatedShared = nTransactionsUpdatedNew;
+    nTimeShared = GetTime();
+    arrTransactionsShared = BlockTemplateTransactions(*pblocktemplateShared);
+}
+
+// A copy of the shared template for getwork, paying to a key of reservekey
+static CBlockTemplate* CopySharedBlockTemplate(CReserveKey& reservekey, int64 nMaxAge)
+{
+    CPubKey pubkey;
+    if (!reservekey.GetReservedKey(pubkey))
+        return NULL;
+
+    LOCK(cs_blocktemplate);
+    UpdateSharedBlockTemplate(nMaxAge);
+    CBlockTemplate* pblocktemplate = new CBlockTemplate(*pblocktemplateShared);
+    CTransaction& txCoinbase = pblocktemplate->block.vtx[0];
+    txCoinbase.vout[0].scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
+    pblocktemplate->vTxSigOps[0] = txCoinbase.GetLegacySigOpCount();
+    return pblocktemplate;
+}
+
 Value getgenerate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -208,8 +308,8 @@ Value getworkex(const Array& params, bool fHelp)
             CBlockIndex* pindexPrevNew = pindexBest;
             nStart = GetTime();
 
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
+            // Take a copy of the shared block
+            pblocktemplate = CopySharedBlockTemplate(*pMiningKey, 60);
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
             vNewBlockTemplate.push_back(pblocktemplate);
@@ -236,7 +336,7 @@ Value getworkex(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -347,8 +447,8 @@ Value getwork(const Array& params, bool fHelp)
             CBlockIndex* pindexPrevNew = pindexBest;
             nStart = GetTime();
 
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
+            // Take a copy of the shared block
+            pblocktemplate = CopySharedBlockTemplate(*pMiningKey, 60);
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
             vNewBlockTemplate.push_back(pblocktemplate);
@@ -375,7 +475,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -432,9 +532,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass back in [params] to wait until the template changes\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -447,6 +549,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -458,80 +561,50 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "LitecoinDark is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64 nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (lpval.type() == str_type)
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
+        // Wait to respond until either the best block changes, or a minute
+        // has passed and there are more transactions. No locks are held here.
+        // Format: <hashBestChain><nTransactionsUpdated>
+        std::string lpstr = lpval.get_str();
+        uint256 hashWatchedChain;
+        hashWatchedChain.SetHex(lpstr.substr(0, 64));
+        unsigned int nTransactionsUpdatedLastLP = lpstr.size() > 64 ? atoi64(lpstr.substr(64)) : 0;
+
+        boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        while (hashBestChain == hashWatchedChain && !ShutdownRequested())
         {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
+            if (!cvBlockChange.timed_wait(lock, checktxtime))
+            {
+                // Timeout: check transactions for update
+                if (nTransactionsUpdated != nTransactionsUpdatedLastLP)
+                    break;
+                checktxtime += boost::posix_time::seconds(10);
+            }
         }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
     }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    else if (lpval.type() != null_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+
+    LOCK2(cs_main, cs_blocktemplate);
+
+    // Update block
+    UpdateSharedBlockTemplate(5);
+    CBlockIndex* pindexPrev = pindexPrevShared;
+    CBlock* pblock = &pblocktemplateShared->block; // pointer for convenience
 
     // Update nTime
     pblock->UpdateTime(pindexPrev);
     pblock->nNonce = 0;
 
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        Object entry;
-
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
-    }
-
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     static Array aMutable;
     if (aMutable.empty())
@@ -544,9 +617,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("transactions", arrTransactionsShared));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedShared)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -16,6 +16,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
+#include <openssl/sha.h>
+
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
 
 
@@ -1025,66 +1027,101 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
-
-class CSignatureCache
+CSignatureCache::CSignatureCache(size_t nBytes) : pAlloc(NULL), pBuckets(NULL), nBucketMask(0)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    salt = GetRandHash();
+    if (nBytes < sizeof(CBucket))
+        return;
+
+    // Largest power of two number of buckets that fits, so a mask picks one
+    uint64_t nBuckets = 1;
+    while (nBuckets * 2 * sizeof(CBucket) <= nBytes)
+        nBuckets *= 2;
+    nBucketMask = nBuckets - 1;
+
+    // Align the table to cache lines
+    pAlloc = new char[nBuckets * sizeof(CBucket) + 63];
+    pBuckets = (CBucket*)(((uintptr_t)pAlloc + 63) & ~(uintptr_t)63);
+    for (uint64_t i = 0; i < nBuckets; i++)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        new (&pBuckets[i]) CBucket();
+        for (unsigned int j = 0; j < BUCKET_SLOTS; j++)
+            pBuckets[i].nSlot[j].store(0, std::memory_order_relaxed);
     }
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+CSignatureCache::~CSignatureCache()
+{
+    delete[] pAlloc;
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+void CSignatureCache::GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey,
+                               CBucket*& pBucketRet, uint64_t& nFingerprintRet, unsigned int& nVictimRet) const
+{
+    unsigned int nSigSize = vchSig.size();
+    uint64_t digest[4];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, salt.begin(), salt.size());
+    SHA256_Update(&ctx, hash.begin(), hash.size());
+    SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+    if (nSigSize)
+        SHA256_Update(&ctx, &vchSig[0], nSigSize);
+    SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+    SHA256_Final((unsigned char*)digest, &ctx);
+
+    pBucketRet = &pBuckets[digest[0] & nBucketMask];
+    // Zero marks an empty slot
+    nFingerprintRet = digest[1] ? digest[1] : 1;
+    nVictimRet = digest[2] % BUCKET_SLOTS;
+}
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+bool CSignatureCache::Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    if (!pBuckets)
+        return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    CBucket* pBucket;
+    uint64_t nFingerprint;
+    unsigned int nVictim;
+    GetEntry(hash, vchSig, pubKey, pBucket, nFingerprint, nVictim);
+    for (unsigned int i = 0; i < BUCKET_SLOTS; i++)
+        if (pBucket->nSlot[i].load(std::memory_order_relaxed) == nFingerprint)
+            return true;
+    return false;
+}
+
+void CSignatureCache::Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (!pBuckets)
+        return;
+
+    CBucket* pBucket;
+    uint64_t nFingerprint;
+    unsigned int nVictim;
+    GetEntry(hash, vchSig, pubKey, pBucket, nFingerprint, nVictim);
+    for (unsigned int i = 0; i < BUCKET_SLOTS; i++)
+    {
+        uint64_t nSlot = pBucket->nSlot[i].load(std::memory_order_relaxed);
+        if (nSlot == nFingerprint)
+            return;
+        if (nSlot == 0 && pBucket->nSlot[i].compare_exchange_strong(nSlot, nFingerprint, std::memory_order_relaxed))
+            return;
     }
-};
+
+    // Bucket is full: evict a slot chosen by the salted hash, for the same
+    // reason the old cache evicted at random. Would-be DoS attackers can't
+    // pre-generate a set of signatures that keeps pushing out each other.
+    pBucket->nSlot[nVictim].store(nFingerprint, std::memory_order_relaxed);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
+    // DoS prevention: the table never grows past -sigcachesize megabytes
+    // (8 bytes per entry). Since there are a maximum of 20,000 signature
+    // operations per block, the default of 4MB holds many blocks' worth.
+    static CSignatureCache signatureCache(std::max((int64)0, std::min((int64)16384, GetArg("-sigcachesize", DEFAULT_SIGCACHE_SIZE))) << 20);
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -5,6 +5,7 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,8 @@ class CCoins;
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
+/** Default for -sigcachesize, megabytes of valid signature cache */
+static const unsigned int DEFAULT_SIGCACHE_SIZE = 4;
 
 /** Signature hash types/flags */
 enum
@@ -667,6 +670,48 @@ public:
     }
 };
 
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ *  twice for every transaction (once when accepted into memory pool, and
+ *  again when accepted into the block chain).
+ *
+ *  An entry is a 64-bit fingerprint of a salted SHA256 of (signature hash,
+ *  signature, public key). The table is a fixed array of cache line sized
+ *  buckets and an entry can only live in the bucket its hash selects, so Get
+ *  and Set read or write one cache line with relaxed atomics and script check
+ *  threads never wait on each other. A full bucket overwrites the slot the
+ *  hash points at, which the salt keeps unpredictable to an attacker.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int BUCKET_SLOTS = 8;
+
+private:
+    struct CBucket
+    {
+        std::atomic<uint64_t> nSlot[BUCKET_SLOTS];
+    };
+
+    uint256 salt;
+    char* pAlloc;
+    CBucket* pBuckets;
+    uint64_t nBucketMask;
+
+    void GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey,
+                  CBucket*& pBucketRet, uint64_t& nFingerprintRet, unsigned int& nVictimRet) const;
+
+public:
+    // Uses at most nBytes of memory; nothing is cached if that is less than one bucket
+    CSignatureCache(size_t nBytes);
+    ~CSignatureCache();
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    // Number of entries the table can hold
+    size_t Capacity() const { return pBuckets ? (nBucketMask + 1) * BUCKET_SLOTS : 0; }
+};
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+/*
+ * 8-way scrypt: eight independent 80-byte inputs are hashed at once, with
+ * word k of every lane packed into one 256-bit register. Salsa20/8 then runs
+ * vertically without any shuffles, and the data-dependent reads from the
+ * scratchpad become one gather per word.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include <immintrin.h>
+
+#define SCRYPT_AVX2_WAY 8
+
+#define ROTL_AVX2(a, b) _mm256_or_si256(_mm256_slli_epi32((a), (b)), _mm256_srli_epi32((a), 32 - (b)))
+#define QR_AVX2(d, s1, s2, r) x[d] = _mm256_xor_si256(x[d], ROTL_AVX2(_mm256_add_epi32(x[s1], x[s2]), r))
+
+static inline void xor_salsa8_avx2(__m256i B[16], const __m256i Bx[16])
+{
+	__m256i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		QR_AVX2( 4,  0, 12,  7);  QR_AVX2( 9,  5,  1,  7);
+		QR_AVX2(14, 10,  6,  7);  QR_AVX2( 3, 15, 11,  7);
+
+		QR_AVX2( 8,  4,  0,  9);  QR_AVX2(13,  9,  5,  9);
+		QR_AVX2( 2, 14, 10,  9);  QR_AVX2( 7,  3, 15,  9);
+
+		QR_AVX2(12,  8,  4, 13);  QR_AVX2( 1, 13,  9, 13);
+		QR_AVX2( 6,  2, 14, 13);  QR_AVX2(11,  7,  3, 13);
+
+		QR_AVX2( 0, 12,  8, 18);  QR_AVX2( 5,  1, 13, 18);
+		QR_AVX2(10,  6,  2, 18);  QR_AVX2(15, 11,  7, 18);
+
+		/* Operate on rows. */
+		QR_AVX2( 1,  0,  3,  7);  QR_AVX2( 6,  5,  4,  7);
+		QR_AVX2(11, 10,  9,  7);  QR_AVX2(12, 15, 14,  7);
+
+		QR_AVX2( 2,  1,  0,  9);  QR_AVX2( 7,  6,  5,  9);
+		QR_AVX2( 8, 11, 10,  9);  QR_AVX2(13, 12, 15,  9);
+
+		QR_AVX2( 3,  2,  1, 13);  QR_AVX2( 4,  7,  6, 13);
+		QR_AVX2( 9,  8, 11, 13);  QR_AVX2(14, 13, 12, 13);
+
+		QR_AVX2( 0,  3,  2, 18);  QR_AVX2( 5,  4,  7, 18);
+		QR_AVX2(10,  9,  8, 18);  QR_AVX2(15, 14, 13, 18);
+	}
+
+	for (i = 0; i < 16; i++)
+		B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+void scrypt_1024_1_1_256_sp_avx2(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[SCRYPT_AVX2_WAY][128];
+	union {
+		__m256i i256[32];
+		uint32_t u32[32][SCRYPT_AVX2_WAY];
+	} X;
+	__m256i *V;
+	uint32_t i, k, l;
+
+	V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < SCRYPT_AVX2_WAY; l++) {
+		PBKDF2_SHA256((const uint8_t *)input + l * 80, 80, (const uint8_t *)input + l * 80, 80, 1, B[l], 128);
+		for (k = 0; k < 32; k++)
+			X.u32[k][l] = le32dec(&B[l][4 * k]);
+	}
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i256[k];
+		xor_salsa8_avx2(&X.i256[0], &X.i256[16]);
+		xor_salsa8_avx2(&X.i256[16], &X.i256[0]);
+	}
+
+	// Each lane reads its own row, word k of lane l of row j lives at 32-bit
+	// offset (j * 32 + k) * 8 + l.
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i mask = _mm256_set1_epi32(1023);
+	const int *V32 = (const int *)V;
+	for (i = 0; i < 1024; i++) {
+		__m256i j = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(X.i256[16], mask), 8), lanes);
+		for (k = 0; k < 32; k++)
+			X.i256[k] = _mm256_xor_si256(X.i256[k], _mm256_i32gather_epi32(V32 + k * SCRYPT_AVX2_WAY, j, 4));
+		xor_salsa8_avx2(&X.i256[0], &X.i256[16]);
+		xor_salsa8_avx2(&X.i256[16], &X.i256[0]);
+	}
+
+	for (l = 0; l < SCRYPT_AVX2_WAY; l++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[l][4 * k], X.u32[k][l]);
+		PBKDF2_SHA256((const uint8_t *)input + l * 80, 80, B[l], 128, 1, (uint8_t *)output + l * 32, 32);
+	}
+}
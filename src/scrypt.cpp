@@ -322,6 +322,48 @@ void scrypt_detect_sse2()
 }
 #endif
 
+static int scrypt_way = 1;
+static void (*scrypt_1024_1_1_256_sp_way)(const char *input, char *output, char *scratchpad) = NULL;
+
+void scrypt_detect_multi()
+{
+#if defined(USE_AVX512)
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        scrypt_way = 16;
+        scrypt_1024_1_1_256_sp_way = &scrypt_1024_1_1_256_sp_avx512;
+        printf("scrypt: using 16-way scrypt-avx512 as detected.\n");
+        return;
+    }
+#endif
+#if defined(USE_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scrypt_way = 8;
+        scrypt_1024_1_1_256_sp_way = &scrypt_1024_1_1_256_sp_avx2;
+        printf("scrypt: using 8-way scrypt-avx2 as detected.\n");
+        return;
+    }
+#endif
+    scrypt_way = 1;
+    scrypt_1024_1_1_256_sp_way = NULL;
+}
+
+int scrypt_multi_way()
+{
+    return scrypt_way;
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, unsigned int nCount, char *scratchpad)
+{
+    unsigned int n = 0;
+    if (scrypt_1024_1_1_256_sp_way != NULL)
+        for (; n + scrypt_way <= nCount; n += scrypt_way)
+            scrypt_1024_1_1_256_sp_way(input + n * 80, output + n * 32, scratchpad);
+    for (; n < nCount; n++)
+        scrypt_1024_1_1_256_sp(input + n * 80, output + n * 32, scratchpad);
+}
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
@@ -23,6 +23,24 @@ extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output,
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
 
+/** Largest number of headers a multi-way scrypt kernel hashes in one pass */
+static const int SCRYPT_MAX_WAY = 16;
+/** Scratchpad for scrypt_1024_1_1_256_multi(), too large to live on a thread's stack */
+static const int SCRYPT_MULTI_SCRATCHPAD_SIZE = SCRYPT_MAX_WAY * 131072 + 63;
+
+void scrypt_detect_multi();
+/** Number of headers hashed together by the kernel scrypt_detect_multi() picked, 1 without one */
+int scrypt_multi_way();
+/** Hash nCount consecutive 80-byte headers into nCount consecutive 32-byte hashes */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, unsigned int nCount, char *scratchpad);
+
+#if defined(USE_AVX2)
+void scrypt_1024_1_1_256_sp_avx2(const char *input, char *output, char *scratchpad);
+#endif
+#if defined(USE_AVX512)
+void scrypt_1024_1_1_256_sp_avx512(const char *input, char *output, char *scratchpad);
+#endif
+
 void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen);
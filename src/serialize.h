@@ -1358,4 +1358,51 @@ public:
     }
 };
 
+/** Non-owning input stream over a range of memory, such as a mapped file.
+ *
+ * Unlike CDataStream, it deserializes straight from the memory it is given,
+ * without copying it into a buffer first. The memory has to outlive it.
+ */
+class CMemoryReader
+{
+private:
+    const char *pbegin;
+    const char *pend;
+    const char *pcur;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char *pbeginIn, const char *pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    size_t size() const { return pend - pcur; }
+    bool eof() const { return pcur == pend; }
+    uint64 GetPos() const { return pcur - pbegin; }
+
+    CMemoryReader& read(char *pch, size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
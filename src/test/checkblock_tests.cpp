@@ -63,4 +63,84 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(PoWCache)
+{
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    BOOST_CHECK(pindexGenesisBlock->nStatus & BLOCK_VALID_POW);
+
+    CBlockHeader genesis = pindexGenesisBlock->GetBlockHeader();
+    BOOST_CHECK(CheckBlockProofOfWork(genesis));
+    BOOST_CHECK(CheckBlockProofOfWork(genesis)); // answered from the cache
+
+    CBlockHeader bad = genesis;
+    bad.nNonce++;
+    BOOST_CHECK(!CheckBlockProofOfWork(bad));
+    BOOST_CHECK(!CheckBlockProofOfWork(bad)); // failures are not remembered
+
+    // While reindexing, headers the old block tree verified are trusted
+    std::vector<uint256> vHash;
+    vHash.push_back(bad.GetHash());
+    SetReindexProofOfWork(vHash);
+    BOOST_CHECK(CheckBlockProofOfWork(bad));
+    SetReindexProofOfWork(vHash); // vHash was taken over and is empty now
+    BOOST_CHECK(!CheckBlockProofOfWork(bad));
+}
+
+BOOST_AUTO_TEST_CASE(PreCheck)
+{
+    CBlock genesis;
+    BOOST_REQUIRE(genesis.ReadFromDisk(pindexGenesisBlock));
+
+    CBlock bad = genesis;
+    bad.hashMerkleRoot = 0; // breaks both merkle root and proof of work
+
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<const CBlock*> vpblock;
+    vHeaders.push_back(genesis.GetBlockHeader());
+    vHeaders.push_back(bad.GetBlockHeader());
+    vpblock.push_back(&genesis);
+    vpblock.push_back(&bad);
+    PreCheckBlocks(vHeaders, vpblock);
+
+    // Pre-checking only saves work, it never decides
+    CValidationState state;
+    BOOST_CHECK(genesis.fPreChecked && bad.fPreChecked);
+    BOOST_CHECK(genesis.CheckBlock(state));
+    BOOST_CHECK(!bad.CheckBlock(state, false, true));
+    BOOST_CHECK(!CheckBlockProofOfWork(bad));
+}
+
+BOOST_AUTO_TEST_CASE(ConnectTimings)
+{
+    CConnectTimings timings(100);
+    CConnectStageStats stats;
+    timings.Get(CONNECT_UNDO, stats);
+    BOOST_CHECK_EQUAL(stats.nCount, 0U);
+    BOOST_CHECK_EQUAL(stats.nWindow, 0U);
+
+    // 1..100 in scrambled order
+    for (int i = 0; i < 100; i++)
+        timings.Add(CONNECT_UNDO, 1 + (i * 37) % 100);
+    timings.Get(CONNECT_UNDO, stats);
+    BOOST_CHECK_EQUAL(stats.nWindow, 100U);
+    BOOST_CHECK_EQUAL(stats.nMin, 1);
+    BOOST_CHECK_EQUAL(stats.nMedian, 50);
+    BOOST_CHECK_EQUAL(stats.n90th, 90);
+    BOOST_CHECK_EQUAL(stats.n99th, 99);
+    BOOST_CHECK_EQUAL(stats.nMax, 100);
+    BOOST_CHECK_EQUAL(stats.nMean, 50);
+
+    // Newer samples push the oldest out of the window
+    for (int i = 0; i < 150; i++)
+        timings.Add(CONNECT_UNDO, 1000);
+    timings.Get(CONNECT_UNDO, stats);
+    BOOST_CHECK_EQUAL(stats.nCount, 250U);
+    BOOST_CHECK_EQUAL(stats.nWindow, 100U);
+    BOOST_CHECK_EQUAL(stats.nMin, 1000);
+
+    // Stages are kept apart
+    timings.Get(CONNECT_INDEX, stats);
+    BOOST_CHECK_EQUAL(stats.nCount, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
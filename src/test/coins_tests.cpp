@@ -0,0 +1,318 @@
+//
+// Unit tests for the coins cache
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+// A coins database in a map, counting what reaches it
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    map<uint256, CCoins> mapCoins;
+    CBlockIndex *pindexBest;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : pindexBest(NULL), nWrites(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        map<uint256, CCoins>::iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        return mapCoins.count(txid) > 0;
+    }
+
+    CBlockIndex *GetBestBlock() { return pindexBest; }
+
+    bool SetBestBlock(CBlockIndex *pindex)
+    {
+        pindexBest = pindex;
+        return true;
+    }
+
+    bool BatchWrite(CCoinsMap &mapBatch, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::iterator it = mapBatch.begin(); it != mapBatch.end(); it = mapBatch.erase(it))
+        {
+            if (!(it->second.nFlags & CCoinsCacheEntry::DIRTY))
+                continue;
+            nWrites++;
+            // Like the database: spent transactions are erased
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        pindexBest = pindex;
+        return true;
+    }
+};
+
+static CCoins RandomCoins()
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = insecure_rand() % 1000;
+    coins.vout.resize(1 + insecure_rand() % 3);
+    BOOST_FOREACH(CTxOut &out, coins.vout)
+    {
+        out.nValue = 1 + insecure_rand() % 1000;
+        out.scriptPubKey = CScript() << OP_TRUE;
+    }
+    return coins;
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_cache_flags)
+{
+    CCoinsViewTest base;
+    uint256 hashOld = GetRandHash(), hashRead = GetRandHash(), hashNew = GetRandHash(), hashKept = GetRandHash();
+    base.mapCoins[hashOld] = RandomCoins();
+    base.mapCoins[hashRead] = RandomCoins();
+
+    {
+        CCoinsViewCache cache(base);
+
+        // Only read: never written back
+        BOOST_CHECK(cache.GetCoins(hashRead) == base.mapCoins[hashRead]);
+
+        // Created and spent before the flush: the base never sees it
+        *cache.ModifyNewCoins(hashNew) = RandomCoins();
+        BOOST_CHECK(cache.HaveCoins(hashNew));
+        *cache.ModifyCoins(hashNew) = CCoins();
+        BOOST_CHECK(!cache.HaveCoins(hashNew));
+
+        // Spending what the base has, and creating something that stays
+        *cache.ModifyCoins(hashOld) = CCoins();
+        CCoins coinsKept = RandomCoins();
+        *cache.ModifyNewCoins(hashKept) = coinsKept;
+
+        size_t nUsage = cache.DynamicMemoryUsage();
+        BOOST_CHECK(nUsage > 0);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage);
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+
+        BOOST_CHECK_EQUAL(base.nWrites, 2U);
+        BOOST_CHECK(!base.mapCoins.count(hashOld));
+        BOOST_CHECK(!base.mapCoins.count(hashNew));
+        BOOST_CHECK(base.mapCoins[hashKept] == coinsKept);
+    }
+
+    // A spent transaction being created again in the cache that spent it
+    // still has to reach the base, which holds the unspent version
+    base.nWrites = 0;
+    {
+        CCoinsViewCache cache(base);
+        *cache.ModifyCoins(hashKept) = CCoins();
+        *cache.ModifyNewCoins(hashKept) = RandomCoins();
+        *cache.ModifyCoins(hashKept) = CCoins();
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 1U);
+        BOOST_CHECK(!base.mapCoins.count(hashKept));
+    }
+}
+
+// Random changes through a stack of caches, flushed and replaced at random,
+// must always read back like a plain map would.
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    map<uint256, CCoins> mapResult;
+    CCoinsViewTest base;
+    vector<CCoinsViewCache*> vStack;
+    vStack.push_back(new CCoinsViewCache(base));
+
+    vector<uint256> vTxids(300);
+    BOOST_FOREACH(uint256 &txid, vTxids)
+        txid = GetRandHash();
+
+    for (unsigned int i = 0; i < 20000; i++)
+    {
+        const uint256 &txid = vTxids[insecure_rand() % vTxids.size()];
+        CCoins &coins = mapResult[txid];
+        {
+            CCoinsModifier entry = vStack.back()->ModifyCoins(txid);
+            BOOST_CHECK(coins == *entry);
+            if (coins.IsPruned() || insecure_rand() % 4 == 0)
+                coins = RandomCoins();
+            else
+                coins = CCoins();
+            *entry = coins;
+        }
+
+        // Now and then read everything back through the top cache
+        if (insecure_rand() % 50 == 0)
+        {
+            BOOST_FOREACH(const uint256 &txidCheck, vTxids)
+            {
+                CCoins coinsCheck;
+                bool fHave = vStack.back()->GetCoins(txidCheck, coinsCheck);
+                const CCoins &coinsExpected = mapResult[txidCheck];
+                if (coinsExpected.IsPruned())
+                    BOOST_CHECK(!fHave || coinsCheck.IsPruned());
+                else
+                    BOOST_CHECK(fHave && coinsCheck == coinsExpected);
+            }
+        }
+
+        // Flush the top cache or change the depth of the stack
+        if (insecure_rand() % 100 == 0)
+            BOOST_CHECK(vStack.back()->Flush());
+        if (insecure_rand() % 100 == 0)
+        {
+            if (vStack.size() > 1 && insecure_rand() % 2 == 0)
+            {
+                BOOST_CHECK(vStack.back()->Flush());
+                delete vStack.back();
+                vStack.pop_back();
+            }
+            else if (vStack.size() < 4)
+                vStack.push_back(new CCoinsViewCache(*vStack.back(), true));
+        }
+    }
+
+    while (!vStack.empty())
+    {
+        BOOST_CHECK(vStack.back()->Flush());
+        delete vStack.back();
+        vStack.pop_back();
+    }
+    for (map<uint256, CCoins>::iterator it = mapResult.begin(); it != mapResult.end(); it++)
+    {
+        if (it->second.IsPruned())
+            BOOST_CHECK(!base.mapCoins.count(it->first));
+        else
+            BOOST_CHECK(base.mapCoins[it->first] == it->second);
+    }
+}
+
+// The scan decodes database records without building CCoins; it must hash
+// and count them like CCoins would.
+BOOST_AUTO_TEST_CASE(coins_stats)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsMap mapBatch;
+    // By raw key, the order the database iterates in
+    map<string, pair<uint256, CCoins> > mapSorted;
+    for (unsigned int i = 0; i < 100; i++)
+    {
+        uint256 txid = GetRandHash();
+        CCoins coins = RandomCoins();
+        coins.vout.resize(coins.vout.size() + insecure_rand() % 20);
+        coins.vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+        mapBatch[txid].coins = coins;
+        mapBatch[txid].nFlags = CCoinsCacheEntry::DIRTY;
+        mapSorted[string(txid.begin(), txid.end())] = make_pair(txid, coins);
+    }
+    BOOST_CHECK(db.BatchWrite(mapBatch, pindexGenesisBlock));
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashGenesisBlock;
+    int64 nTotalAmount = 0;
+    uint64 nOutputs = 0;
+    for (map<string, pair<uint256, CCoins> >::iterator it = mapSorted.begin(); it != mapSorted.end(); it++)
+    {
+        const CCoins &coins = it->second.second;
+        ss << it->second.first << VARINT(coins.nVersion) << (coins.fCoinBase ? 'c' : 'n') << VARINT(coins.nHeight);
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+        {
+            if (coins.vout[i].IsNull())
+                continue;
+            ss << VARINT(i+1) << coins.vout[i];
+            nTotalAmount += coins.vout[i].nValue;
+            nOutputs++;
+        }
+        ss << VARINT(0);
+    }
+
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(stats.hashBlock == hashGenesisBlock);
+    BOOST_CHECK_EQUAL(stats.nHeight, 0);
+    BOOST_CHECK_EQUAL(stats.nTransactions, 100U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nOutputs);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, nTotalAmount);
+    BOOST_CHECK(stats.hashSerialized == ss.GetHash());
+}
+
+// A snapshot written from one database and loaded into another reproduces
+// it; a damaged snapshot is refused.
+BOOST_AUTO_TEST_CASE(coins_txoutset_file)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsMap mapBatch;
+    for (unsigned int i = 0; i < 200; i++)
+    {
+        uint256 txid = GetRandHash();
+        mapBatch[txid].coins = RandomCoins();
+        mapBatch[txid].nFlags = CCoinsCacheEntry::DIRTY;
+    }
+    CCoinsMap mapExpected = mapBatch;
+    BOOST_CHECK(db.BatchWrite(mapBatch, pindexGenesisBlock));
+
+    boost::filesystem::path path = GetDataDir() / "txoutset_test.dat";
+    CCoinsStats stats;
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(db.WriteTxOutSet(fileout, stats));
+    }
+    CCoinsStats statsPlain;
+    BOOST_CHECK(db.GetStats(statsPlain));
+    BOOST_CHECK(stats.hashSerialized == statsPlain.hashSerialized);
+    BOOST_CHECK_EQUAL(stats.nTransactions, 200U);
+
+    // Loading replaces whatever the target held
+    CCoinsViewDB dbLoaded(1 << 20, true);
+    uint256 txidStale = GetRandHash();
+    mapBatch[txidStale].coins = RandomCoins();
+    mapBatch[txidStale].nFlags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(dbLoaded.BatchWrite(mapBatch, NULL));
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCoinsStats statsLoaded;
+        BOOST_CHECK(dbLoaded.LoadTxOutSet(filein, statsLoaded));
+        BOOST_CHECK(statsLoaded.hashSerialized == stats.hashSerialized);
+    }
+    CCoinsStats statsLoaded;
+    BOOST_CHECK(dbLoaded.GetStats(statsLoaded));
+    BOOST_CHECK(statsLoaded.hashBlock == hashGenesisBlock);
+    BOOST_CHECK(statsLoaded.hashSerialized == stats.hashSerialized);
+    BOOST_CHECK(!dbLoaded.HaveCoins(txidStale));
+    for (CCoinsMap::iterator it = mapExpected.begin(); it != mapExpected.end(); it++)
+    {
+        CCoins coins;
+        BOOST_CHECK(dbLoaded.GetCoins(it->first, coins) && coins == it->second.coins);
+    }
+
+    // Flip one byte in the middle of the records
+    {
+        FILE *file = fopen(path.string().c_str(), "r+b");
+        fseek(file, 0, SEEK_END);
+        long nSize = ftell(file);
+        fseek(file, nSize / 2, SEEK_SET);
+        int c = fgetc(file);
+        fseek(file, nSize / 2, SEEK_SET);
+        fputc(c ^ 1, file);
+        fclose(file);
+    }
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCoinsStats statsBad;
+        BOOST_CHECK(!db.VerifyTxOutSet(filein, statsBad));
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+//
+// Unit tests for compact blocks and filling them in from the memory pool
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// A block of nTx transactions: a coinbase, then transactions spending made
+// up outputs, each of about 250 bytes
+static CBlock MakeBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nTime = 1380000000;
+    block.nBits = 0x1e0ffff0;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (i == 0)
+            tx.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+        else
+        {
+            tx.vin[0].prevout.hash = GetRandHash();
+            tx.vin[0].prevout.n = i;
+            tx.vin[0].scriptSig = CScript() << vector<unsigned char>(140, i & 0xff);
+        }
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i * CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1].nValue = COIN;
+        tx.vout[1].scriptPubKey = tx.vout[0].scriptPubKey;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_serialize)
+{
+    CBlock block = MakeBlock(10);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.GetTransactionCount(), 10U);
+    BOOST_REQUIRE_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn[0].nIndex, 0U);
+    BOOST_CHECK(cmpctblock.vPrefilledTxn[0].tx.IsCoinBase());
+
+    uint256 hashKey = cmpctblock.GetShortTxIDKey();
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs[i - 1], CCompactBlock::GetShortTxID(hashKey, block.vtx[i].GetHash()));
+        BOOST_CHECK(cmpctblock.vShortTxIDs[i - 1] < (1ULL << 48));
+    }
+
+    // Six bytes per short id on the wire
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.nNonce, cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.vShortTxIDs == cmpctblock.vShortTxIDs);
+    BOOST_CHECK(cmpctblock2.vPrefilledTxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    CCompactBlock cmpctblock3(block);
+    cmpctblock3.vShortTxIDs.push_back(1);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(cmpctblock3, SER_NETWORK, PROTOCOL_VERSION),
+                      ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION) + 6);
+
+    // Salted per nonce
+    BOOST_CHECK(CCompactBlock(block).vShortTxIDs != cmpctblock.vShortTxIDs);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_reconstruct)
+{
+    CBlock block = MakeBlock(20);
+    CCompactBlock cmpctblock(block);
+
+    // The memory pool has all but a few, plus unrelated transactions
+    CTxMemPool pool;
+    set<unsigned int> setMissing;
+    setMissing.insert(3);
+    setMissing.insert(4);
+    setMissing.insert(19);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (!setMissing.count(i))
+            pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+    CBlock blockOther = MakeBlock(50);
+    for (unsigned int i = 1; i < blockOther.vtx.size(); i++)
+        pool.mapTx[blockOther.vtx[i].GetHash()] = blockOther.vtx[i];
+
+    CPartialBlock partial;
+    BOOST_REQUIRE(partial.Init(cmpctblock, pool));
+    vector<unsigned int> vMissing = partial.GetMissing();
+    BOOST_CHECK(vMissing == vector<unsigned int>(setMissing.begin(), setMissing.end()));
+
+    CBlock blockOut;
+    BOOST_CHECK(!partial.GetBlock(blockOut));
+    vector<CTransaction> vtxMissing;
+    BOOST_CHECK(!partial.FillMissing(vtxMissing));
+    BOOST_FOREACH(unsigned int nIndex, vMissing)
+        vtxMissing.push_back(block.vtx[nIndex]);
+
+    // A wrong transaction changes the merkle root
+    CPartialBlock partialWrong = partial;
+    vector<CTransaction> vtxWrong = vtxMissing;
+    vtxWrong[0] = blockOther.vtx[1];
+    BOOST_CHECK(partialWrong.FillMissing(vtxWrong));
+    BOOST_CHECK(!partialWrong.GetBlock(blockOut));
+
+    BOOST_CHECK(partial.FillMissing(vtxMissing));
+    BOOST_CHECK(partial.GetMissing().empty());
+    BOOST_REQUIRE(partial.GetBlock(blockOut));
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_REQUIRE_EQUAL(blockOut.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockOut.vtx[i].GetHash() == block.vtx[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = MakeBlock(5);
+    CTxMemPool pool;
+    CPartialBlock partial;
+
+    CCompactBlock cmpctblock(block);
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    cmpctblock = CCompactBlock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = 5;
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    cmpctblock = CCompactBlock(block);
+    cmpctblock.vPrefilledTxn.push_back(cmpctblock.vPrefilledTxn[0]);
+    cmpctblock.vShortTxIDs.pop_back();
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    BOOST_CHECK(!partial.Init(CCompactBlock(), pool));
+}
+
+// Not a correctness check: the size of a new block sent in full against as a
+// compact block to a peer whose memory pool had its transactions.
+BOOST_AUTO_TEST_CASE(compactblock_benchmark)
+{
+    CBlock block = MakeBlock(2000);
+    CCompactBlock cmpctblock(block);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+
+    int64 nStart = GetTimeMicros();
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, pool));
+    CBlock blockOut;
+    BOOST_CHECK(partial.GetBlock(blockOut));
+    int64 nTime = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("Block of %u transactions: %u bytes in full, %u as a compact block, filled in from the memory pool in %.2fms",
+                                 (unsigned int)block.vtx.size(),
+                                 (unsigned int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION),
+                                 (unsigned int)::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION),
+                                 nTime / 1000.0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
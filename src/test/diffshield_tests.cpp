@@ -0,0 +1,156 @@
+//
+// Unit tests for the DifficultyShield engines
+//
+#include <boost/test/unit_test.hpp>
+#include <cmath>
+
+#include "bignum.h"
+#include "diffshield.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+using namespace litecoindark::difficulty_shield;
+
+static const int64 nSpacing = 60;
+static const uint64 nPastBlocksMin = 360;
+static const uint64 nPastBlocksMax = 10080;
+
+// The Kimoto Gravity Well loop exactly as it was before the engine learned to
+// cache per-tip results, precompute the event horizon and use uint256 math.
+static unsigned int ReferenceKGW(const CBlockIndex* pindexLast)
+{
+    CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    const CBlockIndex *BlockLastSolved = pindexLast;
+    const CBlockIndex *BlockReading = pindexLast;
+    uint64 PastBlocksMass = 0;
+    int64 PastRateActualSeconds = 0;
+    int64 PastRateTargetSeconds = 0;
+    double PastRateAdjustmentRatio = double(1);
+    CBigNum PastDifficultyAverage;
+    CBigNum PastDifficultyAveragePrev;
+
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < nPastBlocksMin)
+        return bnProofOfWorkLimit.GetCompact();
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (nPastBlocksMax > 0 && i > nPastBlocksMax)
+            break;
+        PastBlocksMass++;
+        if (i == 1)
+            PastDifficultyAverage.SetCompact(BlockReading->nBits);
+        else
+            PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev;
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+
+        PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
+        PastRateTargetSeconds = nSpacing * PastBlocksMass;
+        PastRateAdjustmentRatio = double(1);
+        if (PastRateActualSeconds < 0)
+            PastRateActualSeconds = 0;
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0)
+            PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+
+        double EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+        double EventHorizonDeviationFast = EventHorizonDeviation;
+        double EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
+
+        if (PastBlocksMass >= nPastBlocksMin)
+            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast))
+                break;
+        if (BlockReading->pprev == NULL)
+            break;
+        BlockReading = BlockReading->pprev;
+    }
+
+    CBigNum bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        bnNew *= PastRateActualSeconds;
+        bnNew /= PastRateTargetSeconds;
+    }
+    if (bnNew > bnProofOfWorkLimit)
+        bnNew = bnProofOfWorkLimit;
+    return bnNew.GetCompact();
+}
+
+// A chain whose blocks carry the bits the engine asked for, with block times
+// drawn from a cheap deterministic generator so both the event horizon exit
+// and the past_blocks_max cut-off are exercised.
+struct SyntheticChain
+{
+    vector<uint256> vHash;
+    vector<CBlockIndex> vIndex;
+
+    SyntheticChain(size_t nBlocks, const CBlockIndex* pindexFork, uint32_t nSeed, kgw_difficulty_engine& engine)
+        : vHash(nBlocks), vIndex(nBlocks)
+    {
+        uint32_t nRand = nSeed;
+        for (size_t i = 0; i < nBlocks; i++) {
+            CBlockIndex& index = vIndex[i];
+            const CBlockIndex* pprev = (i == 0) ? pindexFork : &vIndex[i-1];
+            nRand = nRand * 1103515245 + 12345;
+            vHash[i] = Hash(BEGIN(nRand), END(nRand));
+            index.phashBlock = &vHash[i];
+            index.pprev = const_cast<CBlockIndex*>(pprev);
+            index.nHeight = pprev ? pprev->nHeight + 1 : 0;
+            // Alternate fast and slow stretches to make KGW move in both directions
+            int64 nSpread = ((index.nHeight / 500) % 2) ? 20 : 180;
+            index.nTime = pprev ? pprev->nTime + 1 + (nRand >> 8) % nSpread : 1400000000;
+            index.nBits = engine.compute_next_work_required(pprev);
+        }
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(diffshield_tests)
+
+BOOST_AUTO_TEST_CASE(kgw_matches_reference)
+{
+    kgw_difficulty_engine engine(nSpacing, nPastBlocksMin, nPastBlocksMax);
+    SyntheticChain chain(12000, NULL, 42, engine);
+
+    for (size_t i = 0; i < chain.vIndex.size(); i++) {
+        const CBlockIndex* pindex = &chain.vIndex[i];
+        unsigned int nExpected = ReferenceKGW(pindex);
+        BOOST_CHECK_EQUAL(engine.compute_next_work_required(pindex), nExpected);
+        // First call fills the tip cache, second call is answered from it
+        BOOST_CHECK_EQUAL(engine.get_next_work_required(pindex, NULL), nExpected);
+        BOOST_CHECK_EQUAL(engine.get_next_work_required(pindex, NULL), nExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kgw_reorg)
+{
+    kgw_difficulty_engine engine(nSpacing, nPastBlocksMin, nPastBlocksMax);
+    SyntheticChain chain(2000, NULL, 7, engine);
+    for (size_t i = 0; i < chain.vIndex.size(); i++)
+        engine.get_next_work_required(&chain.vIndex[i], NULL);
+
+    // A competing branch off a recent block must not be served stale results
+    SyntheticChain fork(10, &chain.vIndex[1990], 8, engine);
+    for (size_t i = 0; i < fork.vIndex.size(); i++)
+        BOOST_CHECK_EQUAL(engine.get_next_work_required(&fork.vIndex[i], NULL), ReferenceKGW(&fork.vIndex[i]));
+    for (size_t i = 1985; i < chain.vIndex.size(); i++)
+        BOOST_CHECK_EQUAL(engine.get_next_work_required(&chain.vIndex[i], NULL), ReferenceKGW(&chain.vIndex[i]));
+}
+
+// Not a correctness check: reports how the uint256 walk compares to the old
+// CBigNum one when validating headers of a chain at the KGW window limit.
+BOOST_AUTO_TEST_CASE(kgw_benchmark)
+{
+    kgw_difficulty_engine engine(nSpacing, nPastBlocksMin, nPastBlocksMax);
+    SyntheticChain chain(12000, NULL, 42, engine);
+
+    int64 nStart = GetTimeMicros();
+    for (size_t i = 11900; i < chain.vIndex.size(); i++)
+        ReferenceKGW(&chain.vIndex[i]);
+    int64 nReference = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (size_t i = 11900; i < chain.vIndex.size(); i++)
+        engine.compute_next_work_required(&chain.vIndex[i]);
+    int64 nEngine = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("KGW per header: CBigNum %.3fms, uint256 %.3fms", nReference * 0.00001, nEngine * 0.00001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -138,4 +138,37 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// Verification goes through a per-thread cache of decoded public keys; keys
+// that fell out of it and keys that never decoded must still verify right.
+BOOST_AUTO_TEST_CASE(key_verify_cache)
+{
+    uint256 hashMsg = Hash(strSecret1.begin(), strSecret1.end());
+    vector<CKey> vKeys(1100);
+    vector<vector<unsigned char> > vSigs(vKeys.size());
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        BOOST_CHECK(vKeys[i].Sign(hashMsg, vSigs[i]));
+    }
+
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+        {
+            CPubKey pubkey = vKeys[i].GetPubKey();
+            BOOST_CHECK(pubkey.Verify(hashMsg, vSigs[i]));
+            BOOST_CHECK(!pubkey.Verify(hashMsg, vSigs[(i + 1) % vSigs.size()]));
+        }
+    }
+
+    // A well-formed encoding of an x coordinate that is not on the curve
+    vector<unsigned char> vchBad(33, 0);
+    vchBad[0] = 0x02;
+    vchBad[32] = 5;
+    CPubKey pubkeyBad(vchBad);
+    BOOST_CHECK(pubkeyBad.IsValid());
+    BOOST_CHECK(!pubkeyBad.Verify(hashMsg, vSigs[0]));
+    BOOST_CHECK(!pubkeyBad.Verify(hashMsg, vSigs[0]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
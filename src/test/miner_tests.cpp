@@ -120,8 +120,19 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlockWithKey(reservekey));
-    delete pblocktemplate;
+
+    // A template made from the previous one keeps its transactions while
+    // they are in the memory pool, and drops them once they are not
+    CBlockTemplate *pblocktemplateNext;
+    const CScript& scriptCoinbase = pblocktemplate->block.vtx[0].vout[0].scriptPubKey;
+    BOOST_CHECK(pblocktemplateNext = CreateNewBlock(scriptCoinbase, pblocktemplate));
+    BOOST_CHECK(pblocktemplateNext->block.vtx == pblocktemplate->block.vtx);
+    delete pblocktemplateNext;
     mempool.clear();
+    BOOST_CHECK(pblocktemplateNext = CreateNewBlock(scriptCoinbase, pblocktemplate));
+    BOOST_CHECK_EQUAL(pblocktemplateNext->block.vtx.size(), 1U);
+    delete pblocktemplateNext;
+    delete pblocktemplate;
 
     // orphan in mempool
     hash = tx.GetHash();
@@ -205,6 +216,76 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         delete tx;
 }
 
+BOOST_AUTO_TEST_CASE(mempool_indexes)
+{
+    CTxMemPool pool;
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+
+    // Two confirmed coins to spend
+    CTransaction txCoinA, txCoinB;
+    txCoinA.vout.resize(1);
+    txCoinA.vout[0].nValue = 10 * COIN;
+    txCoinB.vout.resize(1);
+    txCoinB.vout[0].nValue = 1 * COIN;
+    txCoinB.nLockTime = 1; // different txid
+    view.SetCoins(txCoinA.GetHash(), CCoins(txCoinA, 1));
+    view.SetCoins(txCoinB.GetHash(), CCoins(txCoinB, 5));
+
+    // parent spends A, child spends the parent and pays the highest fee, other spends B
+    CTransaction txParent, txChild, txOther;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(txCoinA.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 9 * COIN;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 7 * COIN;
+    txOther.vin.resize(1);
+    txOther.vin[0].prevout = COutPoint(txCoinB.GetHash(), 0);
+    txOther.vout.resize(1);
+    txOther.vout[0].nValue = COIN / 2;
+
+    // Add the child first; it is only resolved once the parent arrives
+    pool.addUnchecked(txChild.GetHash(), txChild);
+    pool.addUnchecked(txParent.GetHash(), txParent);
+    pool.addUnchecked(txOther.GetHash(), txOther);
+    pool.updateIndexes(10, view);
+
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.setByPriority.size(), 3U);
+    const CTxMemPoolEntry& parent = pool.mapEntry[txParent.GetHash()];
+    const CTxMemPoolEntry& child = pool.mapEntry[txChild.GetHash()];
+    const CTxMemPoolEntry& other = pool.mapEntry[txOther.GetHash()];
+    BOOST_CHECK(child.setMemPoolParents.size() == 1 && child.setMemPoolParents.count(txParent.GetHash()));
+    BOOST_CHECK(parent.setMemPoolParents.empty());
+
+    // Highest fee rate: child, then other; highest priority: parent
+    BOOST_CHECK(*pool.setByFeeRate.rbegin() == &child);
+    BOOST_CHECK(*pool.setByPriority.rbegin() == &parent);
+    BOOST_CHECK_EQUAL(child.dPriority, 0);
+    BOOST_CHECK_EQUAL(parent.dPriority, 10.0 * COIN * 10 / parent.nTxSize);
+    BOOST_CHECK_EQUAL(other.dPriority, 1.0 * COIN * 6 / other.nTxSize);
+
+    // A block later everything aged
+    pool.updateIndexes(11, view);
+    BOOST_CHECK_EQUAL(parent.dPriority, 10.0 * COIN * 11 / parent.nTxSize);
+    BOOST_CHECK_EQUAL(other.dPriority, 1.0 * COIN * 7 / other.nTxSize);
+
+    // The parent gets mined, so the child's input is confirmed now
+    view.SetCoins(txParent.GetHash(), CCoins(txParent, 12));
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 1U);
+    pool.updateIndexes(12, view);
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 2U);
+    BOOST_CHECK(child.setMemPoolParents.empty());
+    BOOST_CHECK_EQUAL(child.dPriority, 9.0 * COIN / child.nTxSize);
+
+    pool.clear();
+    BOOST_CHECK(pool.setByFeeRate.empty() && pool.setByPriority.empty() && pool.mapEntry.empty());
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
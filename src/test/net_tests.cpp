@@ -0,0 +1,313 @@
+//
+// Unit tests for the epoll socket events of the network thread, and for
+// sending shared message buffers
+//
+#include <boost/test/unit_test.hpp>
+#include <ctime>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+#ifndef WIN32
+
+// Connected pairs of non-blocking sockets: the events watch vRead, vWrite plays the peers
+struct SocketPairs
+{
+    vector<SOCKET> vRead;
+    vector<SOCKET> vWrite;
+
+    SocketPairs(unsigned int nPairs)
+    {
+        for (unsigned int i = 0; i < nPairs; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            vRead.push_back(fds[0]);
+            vWrite.push_back(fds[1]);
+        }
+    }
+
+    ~SocketPairs()
+    {
+        BOOST_FOREACH(SOCKET hSocket, vRead)
+            closesocket(hSocket);
+        BOOST_FOREACH(SOCKET hSocket, vWrite)
+            closesocket(hSocket);
+    }
+};
+
+// Everything the peer at the other end of hSocket has been sent so far
+static string ReceiveAll(SOCKET hSocket)
+{
+    string str;
+    char pch[4096];
+    int nBytes;
+    while ((nBytes = recv(hSocket, pch, sizeof(pch), MSG_DONTWAIT)) > 0)
+        str.append(pch, nBytes);
+    return str;
+}
+
+static string BufferString(const CSendBufferRef& buffer)
+{
+    return string(buffer->begin(), buffer->end());
+}
+#endif
+
+#ifdef USE_EPOLL
+static bool HasEvent(const vector<pair<void*, int> >& vEvents, void *p, int nFlag)
+{
+    for (unsigned int i = 0; i < vEvents.size(); i++)
+        if (vEvents[i].first == p && (vEvents[i].second & nFlag))
+            return true;
+    return false;
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(socketevents_edge)
+{
+    CSocketEvents events;
+    BOOST_REQUIRE(events.IsValid());
+    SocketPairs pairs(1);
+    BOOST_REQUIRE_EQUAL(pairs.vRead.size(), 1U);
+
+    int nTag;
+    vector<pair<void*, int> > vEvents;
+    BOOST_CHECK(events.Add(pairs.vRead[0], &nTag));
+
+    // A new socket is reported writable once
+    BOOST_CHECK(events.Wait(vEvents, 0));
+    BOOST_CHECK(HasEvent(vEvents, &nTag, CSocketEvents::EVENT_SEND));
+    BOOST_CHECK(!HasEvent(vEvents, &nTag, CSocketEvents::EVENT_RECV));
+    BOOST_CHECK(events.Wait(vEvents, 0));
+    BOOST_CHECK(vEvents.empty());
+
+    // Incoming data
+    char pch[64] = {};
+    BOOST_CHECK_EQUAL(send(pairs.vWrite[0], pch, sizeof(pch), MSG_NOSIGNAL), (int)sizeof(pch));
+    BOOST_CHECK(events.Wait(vEvents, 1000));
+    BOOST_CHECK(HasEvent(vEvents, &nTag, CSocketEvents::EVENT_RECV));
+    BOOST_CHECK_EQUAL(recv(pairs.vRead[0], pch, sizeof(pch), MSG_DONTWAIT), (int)sizeof(pch));
+
+    // A wakeup ends the wait without reporting anything
+    int64 nStart = GetTimeMillis();
+    events.Wake();
+    BOOST_CHECK(events.Wait(vEvents, 5000));
+    BOOST_CHECK(vEvents.empty());
+    BOOST_CHECK(GetTimeMillis() - nStart < 2500);
+
+    // The peer going away
+    closesocket(pairs.vWrite[0]);
+    pairs.vWrite[0] = INVALID_SOCKET;
+    BOOST_CHECK(events.Wait(vEvents, 1000));
+    BOOST_CHECK(HasEvent(vEvents, &nTag, CSocketEvents::EVENT_ERROR));
+
+    events.Remove(pairs.vRead[0]);
+}
+
+// Not a correctness check: one peer at a time sends a message to a node with
+// many connections, and the time and CPU until the message is read is
+// reported for epoll against the select() loop it replaces. select() rebuilds
+// and scans its sets on every wakeup, and only takes sockets below FD_SETSIZE.
+BOOST_AUTO_TEST_CASE(socketevents_benchmark)
+{
+    const unsigned int nPairs = 1000;
+    const unsigned int nMessages = 5000;
+    RaiseFileDescriptorLimit(2 * nPairs + 100);
+    SocketPairs pairs(nPairs);
+    unsigned int nSelectPairs = 0;
+    while (nSelectPairs < pairs.vRead.size() && pairs.vRead[nSelectPairs] < FD_SETSIZE)
+        nSelectPairs++;
+
+    char pch[32] = {};
+    vector<pair<void*, int> > vEvents;
+
+    // epoll
+    CSocketEvents events;
+    BOOST_REQUIRE(events.IsValid());
+    for (unsigned int i = 0; i < pairs.vRead.size(); i++)
+        BOOST_CHECK(events.Add(pairs.vRead[i], &pairs.vRead[i]));
+    while (events.Wait(vEvents, 0) && !vEvents.empty());
+
+    int64 nEpollTime = 0;
+    clock_t nEpollCPU = clock();
+    unsigned int nEpollReceived = 0;
+    for (unsigned int n = 0; n < nMessages; n++) {
+        unsigned int i = GetRand(pairs.vRead.size());
+        send(pairs.vWrite[i], pch, sizeof(pch), MSG_NOSIGNAL);
+        int64 nStart = GetTimeMicros();
+        do {
+            if (!events.Wait(vEvents, 1000) || vEvents.empty())
+                break;
+        } while (!HasEvent(vEvents, &pairs.vRead[i], CSocketEvents::EVENT_RECV));
+        if (recv(pairs.vRead[i], pch, sizeof(pch), MSG_DONTWAIT) == (int)sizeof(pch))
+            nEpollReceived++;
+        nEpollTime += GetTimeMicros() - nStart;
+    }
+    nEpollCPU = clock() - nEpollCPU;
+    BOOST_CHECK_EQUAL(nEpollReceived, nMessages);
+
+    // select()
+    int64 nSelectTime = 0;
+    clock_t nSelectCPU = clock();
+    unsigned int nSelectReceived = 0;
+    for (unsigned int n = 0; nSelectPairs > 0 && n < nMessages; n++) {
+        unsigned int i = GetRand(nSelectPairs);
+        send(pairs.vWrite[i], pch, sizeof(pch), MSG_NOSIGNAL);
+        int64 nStart = GetTimeMicros();
+        bool fReady = false;
+        while (!fReady) {
+            fd_set fdsetRecv;
+            FD_ZERO(&fdsetRecv);
+            SOCKET hSocketMax = 0;
+            for (unsigned int j = 0; j < nSelectPairs; j++) {
+                FD_SET(pairs.vRead[j], &fdsetRecv);
+                hSocketMax = max(hSocketMax, pairs.vRead[j]);
+            }
+            struct timeval timeout;
+            timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
+            if (select(hSocketMax + 1, &fdsetRecv, NULL, NULL, &timeout) <= 0)
+                break;
+            for (unsigned int j = 0; j < nSelectPairs; j++)
+                if (FD_ISSET(pairs.vRead[j], &fdsetRecv) && j == i)
+                    fReady = true;
+        }
+        if (recv(pairs.vRead[i], pch, sizeof(pch), MSG_DONTWAIT) == (int)sizeof(pch))
+            nSelectReceived++;
+        nSelectTime += GetTimeMicros() - nStart;
+    }
+    nSelectCPU = clock() - nSelectCPU;
+
+    BOOST_TEST_MESSAGE(strprintf("Message wakeup with %u connections: epoll %.2fus, %.2fus CPU; select() with %u connections: %.2fus, %.2fus CPU",
+                                 (unsigned int)pairs.vRead.size(),
+                                 nEpollTime / (double)nMessages, nEpollCPU * 1000000.0 / CLOCKS_PER_SEC / nMessages,
+                                 nSelectPairs,
+                                 nSelectTime / (double)max(nSelectReceived, 1U), nSelectCPU * 1000000.0 / CLOCKS_PER_SEC / max(nSelectReceived, 1U)));
+}
+
+#endif
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(sendbuffer_shared)
+{
+    string strPayload(1000, 'x');
+    CSendBufferRef buffer = MakeSendBuffer("tx", strPayload.data(), strPayload.size());
+    BOOST_REQUIRE_EQUAL(buffer->size(), CMessageHeader::HEADER_SIZE + strPayload.size());
+
+    CDataStream ssHeader(buffer->begin(), buffer->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, strPayload.size());
+    uint256 hash = Hash(strPayload.begin(), strPayload.end());
+    BOOST_CHECK_EQUAL(hdr.nChecksum, *(unsigned int*)&hash);
+
+    // Both peers get the same bytes, from the one buffer
+    SocketPairs pairs(2);
+    BOOST_REQUIRE_EQUAL(pairs.vRead.size(), 2U);
+    CNode node0(pairs.vRead[0], CAddress(), "", true);
+    CNode node1(pairs.vRead[1], CAddress(), "", true);
+    node0.PushSendBuffer(buffer);
+    node1.PushSendBuffer(buffer);
+    BOOST_CHECK(node0.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(buffer.use_count(), 1);
+    BOOST_CHECK(ReceiveAll(pairs.vWrite[0]) == BufferString(buffer));
+    BOOST_CHECK(ReceiveAll(pairs.vWrite[1]) == BufferString(buffer));
+
+    // A message built by PushMessage matches one built around its payload
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << strPayload;
+    node0.PushMessage("tx", strPayload);
+    BOOST_CHECK(ReceiveAll(pairs.vWrite[0]) == BufferString(MakeSendBuffer("tx", &ssPayload[0], ssPayload.size())));
+
+    // The nodes close their own sockets
+    pairs.vRead.clear();
+}
+
+BOOST_AUTO_TEST_CASE(sendbuffer_partial)
+{
+    SocketPairs pairs(1);
+    BOOST_REQUIRE_EQUAL(pairs.vRead.size(), 1U);
+    CNode node(pairs.vRead[0], CAddress(), "", true);
+
+    // More than the socket takes: the rest stays queued, in order
+    string strExpected;
+    for (unsigned int i = 0; i < 200; i++) {
+        string strPayload(5000 + i, 'a' + i % 26);
+        CSendBufferRef buffer = MakeSendBuffer("tx", strPayload.data(), strPayload.size());
+        strExpected += BufferString(buffer);
+        node.PushSendBuffer(buffer);
+    }
+    BOOST_CHECK(!node.vSendMsg.empty());
+
+    string strReceived;
+    for (unsigned int i = 0; i < 1000 && strReceived.size() < strExpected.size(); i++) {
+        strReceived += ReceiveAll(pairs.vWrite[0]);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    strReceived += ReceiveAll(pairs.vWrite[0]);
+    BOOST_CHECK(strReceived == strExpected);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+
+    pairs.vRead.clear();
+}
+
+// Not a correctness check: a transaction relayed to 125 peers, each getting
+// its own serialized and checksummed copy as before, against all of them
+// sharing one buffer.
+BOOST_AUTO_TEST_CASE(sendbuffer_benchmark)
+{
+    const unsigned int nPeers = 125;
+    const unsigned int nRounds = 20;
+    SocketPairs pairs(nPeers);
+    BOOST_REQUIRE_EQUAL(pairs.vRead.size(), nPeers);
+    vector<CNode*> vNodes;
+    for (unsigned int i = 0; i < nPeers; i++)
+        vNodes.push_back(new CNode(pairs.vRead[i], CAddress(), "", true));
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << string(10000, 't');
+
+    int64 nCopyTime = 0;
+    for (unsigned int n = 0; n < nRounds; n++) {
+        int64 nStart = GetTimeMicros();
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->PushMessage("tx", ssTx);
+        nCopyTime += GetTimeMicros() - nStart;
+        for (unsigned int i = 0; i < nPeers; i++)
+            ReceiveAll(pairs.vWrite[i]);
+    }
+
+    int64 nSharedTime = 0;
+    for (unsigned int n = 0; n < nRounds; n++) {
+        int64 nStart = GetTimeMicros();
+        CSendBufferRef buffer = MakeSendBuffer("tx", &ssTx[0], ssTx.size());
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->PushSendBuffer(buffer);
+        nSharedTime += GetTimeMicros() - nStart;
+        for (unsigned int i = 0; i < nPeers; i++)
+            BOOST_CHECK_EQUAL(ReceiveAll(pairs.vWrite[i]).size(), buffer->size());
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        delete pnode;
+    pairs.vRead.clear();
+
+    BOOST_TEST_MESSAGE(strprintf("Relaying a 10kB transaction to %u peers: copy per peer %.1fus, shared buffer %.1fus",
+                                 nPeers, nCopyTime / (double)nRounds, nSharedTime / (double)nRounds));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -30,4 +30,44 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_multiway)
+{
+    // Hash a full batch of known inputs with the multi-way kernels and check
+    // every lane against the generic implementation
+    const char* inputhex[HASHCOUNT] = { "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659", "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01", "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b", "010000007824bc3a8a1b4628485eee3024abd8626721f7f870f8ad4d2f33a27155167f6a4009d1285049603888fe85a84b6c803a53305a8d497965a5e896e1a00568359589faf551eac7471b0065434e", "0200000050bfd4e4a307a8cb6ef4aef69abc5c0f2d579648bd80d7733e1ccc3fbc90ed664a7f74006cb11bde87785f229ecd366c2d4e44432832580e0608c579e4cb76f383f7f551eac7471b00c36982" };
+    std::vector<char> input(SCRYPT_MAX_WAY * 80);
+    std::vector<uint256> expected(SCRYPT_MAX_WAY);
+    std::vector<uint256> hashes(SCRYPT_MAX_WAY);
+    std::vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    for (int i = 0; i < SCRYPT_MAX_WAY; i++) {
+        std::vector<unsigned char> inputbytes = ParseHex(inputhex[i % HASHCOUNT]);
+        inputbytes[76] += i / HASHCOUNT; // vary the nonce so no two lanes are alike
+        memcpy(&input[i * 80], &inputbytes[0], 80);
+        scrypt_1024_1_1_256_sp_generic(&input[i * 80], BEGIN(expected[i]), &scratchpad[0]);
+    }
+
+#if defined(USE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        scrypt_1024_1_1_256_sp_avx2(&input[0], BEGIN(hashes[0]), &scratchpad[0]);
+        for (int i = 0; i < 8; i++)
+            BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i].ToString());
+    }
+#endif
+#if defined(USE_AVX512)
+    if (__builtin_cpu_supports("avx512f")) {
+        scrypt_1024_1_1_256_sp_avx512(&input[0], BEGIN(hashes[0]), &scratchpad[0]);
+        for (int i = 0; i < 16; i++)
+            BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i].ToString());
+    }
+#endif
+
+    // Whatever kernel was detected, a batch that is not a multiple of its
+    // width must come out the same
+    scrypt_detect_multi();
+    std::fill(hashes.begin(), hashes.end(), 0);
+    scrypt_1024_1_1_256_multi(&input[0], BEGIN(hashes[0]), SCRYPT_MAX_WAY - 3, &scratchpad[0]);
+    for (int i = 0; i < SCRYPT_MAX_WAY - 3; i++)
+        BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i].ToString());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -90,4 +90,32 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(memoryreader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<unsigned char> vch(100, 0x42);
+    ss << (unsigned int)12345 << vch << std::string("block");
+    std::vector<char> vData(ss.begin(), ss.end());
+
+    CMemoryReader reader(&vData[0], &vData[0] + vData.size(), SER_DISK, 0);
+    unsigned int n;
+    std::vector<unsigned char> vchRead;
+    std::string str;
+    reader >> n >> vchRead;
+    BOOST_CHECK_EQUAL(n, 12345U);
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK_EQUAL(reader.GetPos(), 4U + 1 + 100);
+    reader >> str;
+    BOOST_CHECK_EQUAL(str, "block");
+    BOOST_CHECK(reader.eof());
+
+    // Reading or skipping past the end throws, without moving
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    CMemoryReader reader2(&vData[0], &vData[0] + vData.size(), SER_DISK, 0);
+    reader2.ignore(4);
+    BOOST_CHECK_THROW(reader2.ignore(vData.size()), std::ios_base::failure);
+    reader2 >> vchRead;
+    BOOST_CHECK(vchRead == vch);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,173 @@
+//
+// Unit tests for the valid signature cache
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/tuple/tuple.hpp>
+
+#include "key.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// The std::set based cache CSignatureCache used to be, without its eviction
+// and locking, to compare the table against.
+class CReferenceSignatureCache
+{
+public:
+    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
+    std::set<sigdata_type> setValid;
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        return setValid.count(sigdata_type(hash, vchSig, pubKey)) > 0;
+    }
+
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        setValid.insert(sigdata_type(hash, vchSig, pubKey));
+    }
+};
+
+// Entries of the size real ones have: a 72 byte signature, a compressed key
+struct SigEntry
+{
+    uint256 hash;
+    vector<unsigned char> vchSig;
+    CPubKey pubkey;
+
+    SigEntry(uint256 hashIn) : hash(hashIn), vchSig(72)
+    {
+        for (unsigned int i = 0; i < vchSig.size(); i++)
+            vchSig[i] = hash.begin()[i % 32] ^ i;
+        vector<unsigned char> vchPubKey(hash.begin(), hash.end());
+        vchPubKey.insert(vchPubKey.begin(), 0x02);
+        pubkey = CPubKey(vchPubKey);
+    }
+};
+
+static vector<SigEntry> MakeEntries(unsigned int nCount)
+{
+    vector<SigEntry> vEntries;
+    vEntries.reserve(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
+        vEntries.push_back(SigEntry(GetRandHash()));
+    return vEntries;
+}
+
+static void SetAndGet(CSignatureCache* pcache, const vector<SigEntry>* pvEntries, unsigned int nStart, unsigned int nStep, bool* pfOk)
+{
+    for (unsigned int i = nStart; i < pvEntries->size(); i += nStep)
+    {
+        const SigEntry& entry = (*pvEntries)[i];
+        pcache->Set(entry.hash, entry.vchSig, entry.pubkey);
+        if (!pcache->Get(entry.hash, entry.vchSig, entry.pubkey))
+            *pfOk = false;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_lookup)
+{
+    CSignatureCache cache(1 << 20);
+    BOOST_CHECK_EQUAL(cache.Capacity(), (1U << 20) / 8);
+
+    vector<SigEntry> vEntries = MakeEntries(1000);
+    for (unsigned int i = 0; i < vEntries.size(); i += 2)
+        cache.Set(vEntries[i].hash, vEntries[i].vchSig, vEntries[i].pubkey);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK_EQUAL(cache.Get(vEntries[i].hash, vEntries[i].vchSig, vEntries[i].pubkey), i % 2 == 0);
+
+    // Any part of the entry differing is a miss
+    SigEntry entry = vEntries[0];
+    entry.vchSig.back() ^= 1;
+    BOOST_CHECK(!cache.Get(entry.hash, entry.vchSig, entry.pubkey));
+    entry.vchSig.pop_back();
+    BOOST_CHECK(!cache.Get(entry.hash, entry.vchSig, entry.pubkey));
+    BOOST_CHECK(!cache.Get(vEntries[0].hash, vEntries[0].vchSig, vEntries[1].pubkey));
+    BOOST_CHECK(!cache.Get(vEntries[1].hash, vEntries[0].vchSig, vEntries[0].pubkey));
+
+    // Too small to hold a bucket: caches nothing
+    CSignatureCache cacheOff(0);
+    BOOST_CHECK_EQUAL(cacheOff.Capacity(), 0U);
+    cacheOff.Set(vEntries[0].hash, vEntries[0].vchSig, vEntries[0].pubkey);
+    BOOST_CHECK(!cacheOff.Get(vEntries[0].hash, vEntries[0].vchSig, vEntries[0].pubkey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    // 16 buckets of 8 slots; overfill it and most recent entries must still be found
+    CSignatureCache cache(16 * 64 + 63);
+    BOOST_CHECK_EQUAL(cache.Capacity(), 128U);
+
+    vector<SigEntry> vEntries = MakeEntries(1024);
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+        cache.Set(entry.hash, entry.vchSig, entry.pubkey);
+
+    unsigned int nFound = 0;
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+        nFound += cache.Get(entry.hash, entry.vchSig, entry.pubkey);
+    BOOST_CHECK(nFound <= cache.Capacity());
+    BOOST_CHECK(nFound > cache.Capacity() / 2);
+    const SigEntry& entryLast = vEntries.back();
+    BOOST_CHECK(cache.Get(entryLast.hash, entryLast.vchSig, entryLast.pubkey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_threads)
+{
+    CSignatureCache cache(4 << 20);
+    vector<SigEntry> vEntries = MakeEntries(40000);
+
+    bool fOk[4] = { true, true, true, true };
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&SetAndGet, &cache, &vEntries, i, 4, &fOk[i]));
+    threadGroup.join_all();
+
+    for (unsigned int i = 0; i < 4; i++)
+        BOOST_CHECK(fOk[i]);
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+        BOOST_CHECK(cache.Get(entry.hash, entry.vchSig, entry.pubkey));
+}
+
+// Not a correctness check: reports hit latency and memory per entry of the
+// table against the set, filled with a few blocks' worth of signatures.
+BOOST_AUTO_TEST_CASE(sigcache_benchmark)
+{
+    const unsigned int nEntries = 50000;
+    vector<SigEntry> vEntries = MakeEntries(nEntries);
+
+    CReferenceSignatureCache reference;
+    CSignatureCache cache(DEFAULT_SIGCACHE_SIZE << 20);
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+    {
+        reference.Set(entry.hash, entry.vchSig, entry.pubkey);
+        cache.Set(entry.hash, entry.vchSig, entry.pubkey);
+    }
+
+    unsigned int nHits = 0;
+    int64 nStart = GetTimeMicros();
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+        nHits += reference.Get(entry.hash, entry.vchSig, entry.pubkey);
+    int64 nReference = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nHits, nEntries);
+
+    nHits = 0;
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const SigEntry& entry, vEntries)
+        nHits += cache.Get(entry.hash, entry.vchSig, entry.pubkey);
+    int64 nTable = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nHits, nEntries);
+
+    // A set node is the tuple, a signature allocation and the tree links,
+    // each with a malloc header.
+    size_t nReferenceBytes = sizeof(CReferenceSignatureCache::sigdata_type) + 4 * sizeof(void*) + 16 +
+                             vEntries[0].vchSig.capacity() + 16;
+    BOOST_TEST_MESSAGE(strprintf("Signature cache hit: set %.3fus, table %.3fus; bytes per entry: set ~%u, table %u",
+                                 nReference / (double)nEntries, nTable / (double)nEntries,
+                                 (unsigned int)nReferenceBytes, (unsigned int)sizeof(uint64_t)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -15,7 +15,6 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
@@ -35,8 +34,10 @@ struct TestingSetup {
         pwalletMain->LoadWallet(fFirstRun);
         RegisterWallet(pwalletMain);
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadBlockPreCheck);
+        }
     }
     ~TestingSetup()
     {
@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
 #include "uint256.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +17,84 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_SetCompact)
+{
+    uint256 num;
+    bool fNegative;
+    bool fOverflow;
+    num.SetCompact(0, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "0000000000000000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x00123456, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x01123456, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "0000000000000000000000000000000000000000000000000000000000000012");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x01120000U);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    // Make sure that we don't generate compacts with the 0x00800000 bit set
+    num = 0x80;
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x02008000U);
+
+    num.SetCompact(0x01fedcba, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+
+    num.SetCompact(0x05009234, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "0000000000000000000000000000000000000000000000000000000092340000");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x05009234U);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x20123456, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "1234560000000000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x20123456U);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x21123456, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && fOverflow);
+
+    num.SetCompact(0xff123456, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && fOverflow);
+}
+
+// The difficulty code used to run on CBigNum, so uint256 has to agree with it
+// on every value that can occur there.
+BOOST_AUTO_TEST_CASE(uint256_matches_bignum)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        unsigned int nCompact = (GetRandInt(0x21) << 24) | GetRandInt(0x800000);
+        bool fNegative;
+        bool fOverflow;
+        uint256 num;
+        num.SetCompact(nCompact, &fNegative, &fOverflow);
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        BOOST_CHECK(!fNegative && !fOverflow);
+        BOOST_CHECK(num == bn.getuint256());
+        BOOST_CHECK_EQUAL(num.GetCompact(), bn.GetCompact());
+        if (bn > 0)
+        {
+            CBigNum bnWork = (CBigNum(1)<<256) / (bn+1);
+            BOOST_CHECK((~num / (num + 1)) + 1 == bnWork.getuint256());
+        }
+
+        uint64 nMul = GetRand(100000) + 1;
+        uint64 nDiv = GetRand(1000000) + 1;
+        if ((num * nMul) / nMul == num)
+            BOOST_CHECK(num * nMul / nDiv == (bn * CBigNum(nMul) / CBigNum(nDiv)).getuint256());
+
+        uint256 num2 = GetRandHash();
+        uint256 num3 = GetRandHash() >> GetRandInt(256);
+        if (num3 != 0)
+            BOOST_CHECK(num2 / num3 == (CBigNum(num2) / CBigNum(num3)).getuint256());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,4 +1,5 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 #include "main.h"
 #include "wallet.h"
@@ -292,4 +293,40 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+// Notifications handed to the notification thread are all delivered, in
+// order, by the time FlushWalletNotifications returns
+BOOST_AUTO_TEST_CASE(wallet_notify_queue)
+{
+    CWallet walletNotify("wallet_notify_test.dat");
+    RegisterWallet(&walletNotify);
+    boost::thread thread(&ThreadWalletNotify);
+
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(walletNotify.GenerateNewKey().GetID());
+    vector<uint256> vHash;
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.push_back(CTxOut(i + 1, scriptPubKey));
+        vHash.push_back(tx.GetHash());
+        SyncWithWallets(vHash.back(), tx, NULL, true);
+    }
+    FlushWalletNotifications();
+    {
+        LOCK(walletNotify.cs_wallet);
+        for (int i = 0; i < 20; i++)
+        {
+            BOOST_CHECK(walletNotify.mapWallet.count(vHash[i]));
+            if (i > 0)
+                BOOST_CHECK(walletNotify.mapWallet[vHash[i]].nOrderPos > walletNotify.mapWallet[vHash[i-1]].nOrderPos);
+        }
+    }
+
+    thread.interrupt();
+    thread.join();
+    UnregisterWallet(&walletNotify);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,8 @@
 #include "main.h"
 #include "hash.h"
 
+#include <boost/utility/addressof.hpp>
+
 using namespace std;
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -53,15 +55,20 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    size_t nCount = 0, nChanged = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+        if (it->second.nFlags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteCoins(batch, it->first, it->second.coins);
+            nChanged++;
+        }
+        nCount++;
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    printf("Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)nChanged, (unsigned int)nCount);
     return db.WriteBatch(batch);
 }
 
@@ -111,57 +118,284 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
+bool CBlockTreeDB::WriteSyncMarker(int nFile, unsigned int nSize, unsigned int nUndoSize) {
+    return Write('S', boost::make_tuple(nFile, nSize, nUndoSize), true);
+}
+
+bool CBlockTreeDB::ReadSyncMarker(int &nFile, unsigned int &nSize, unsigned int &nUndoSize) {
+    boost::tuple<int, unsigned int, unsigned int> marker;
+    if (!Read('S', marker))
+        return false;
+    boost::tie(nFile, nSize, nUndoSize) = marker;
+    return true;
+}
+
+bool CBlockTreeDB::EraseSyncMarker() {
+    return Erase('S', true);
+}
+
+// Hash and count the coins of one database record as stored, without building
+// a CCoins. It is the same hash CCoins would give: for every transaction its
+// id, version, coinbase flag and height, then each unspent output with its
+// index, then a terminator. ssOuts and vchMask are reused between records.
+void static HashCoinsRecord(CHashWriter &ss, CCoinsStats &stats, const uint256 &txhash, CMemoryReader &ssValue,
+                            CDataStream &ssOuts, std::vector<unsigned char> &vchMask, CTxOut &txout) {
+    unsigned int nVersion = 0, nCode = 0, nHeight = 0;
+    ssValue >> VARINT(nVersion) >> VARINT(nCode);
+    bool fCoinBase = nCode & 1;
+
+    // spentness bitmask: outputs 0 and 1 are in the header code
+    unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+    vchMask.clear();
+    while (nMaskCode > 0) {
+        unsigned char chAvail = 0;
+        ssValue >> chAvail;
+        vchMask.push_back(chAvail);
+        if (chAvail != 0)
+            nMaskCode--;
+    }
+
+    ssOuts.clear();
+    for (unsigned int i = 0; i < 2 + 8 * vchMask.size(); i++) {
+        bool fAvail = i < 2 ? (nCode & (2 << i)) != 0 : (vchMask[(i - 2) / 8] & (1 << ((i - 2) % 8))) != 0;
+        if (!fAvail)
+            continue;
+        ssValue >> REF(CTxOutCompressor(txout));
+        ssOuts << VARINT(i+1) << txout;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += txout.nValue;
+    }
+    ssValue >> VARINT(nHeight);
+
+    ss << txhash;
+    ss << VARINT(nVersion);
+    ss << (fCoinBase ? 'c' : 'n');
+    ss << VARINT(nHeight);
+    if (!ssOuts.empty())
+        ss.write(&ssOuts[0], ssOuts.size());
+    ss << VARINT(0);
+    stats.nTransactions++;
+}
+
+// Append what ss holds to a UTXO snapshot file and its checksum
+void static WriteTxOutSetData(CAutoFile &fileout, CHashWriter &hasher, CDataStream &ss) {
+    if (!ss.empty()) {
+        fileout.write(&ss[0], ss.size());
+        hasher.write(&ss[0], ss.size());
+    }
+    ss.clear();
+}
+
+bool CCoinsViewDB::ScanTxOutSet(CCoinsStats &stats, CAutoFile *pfileout) {
+    // Scan a snapshot, so blocks keep being connected meanwhile. Its best
+    // block record sorts before all coins.
+    const leveldb::Snapshot *snapshot = db.GetSnapshot();
+    leveldb::Iterator *pcursor = db.NewIterator(snapshot);
     pcursor->SeekToFirst();
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
+    CDataStream ssOuts(SER_GETHASH, PROTOCOL_VERSION);
+    std::vector<unsigned char> vchMask;
+    CTxOut txout;
+    CHashWriter hasherFile(SER_DISK, CLIENT_VERSION);
+    CDataStream ssFile(SER_DISK, CLIENT_VERSION);
+    std::vector<char> vchValue;
+    int nProgressReported = 0;
+    bool fOk = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+            leveldb::Slice slValue = pcursor->value();
+            if (slKey.size() == 1 && slKey[0] == 'B') {
+                CMemoryReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> stats.hashBlock;
+                ss << stats.hashBlock;
+                if (pfileout) {
+                    ssFile << FLATDATA(pchTxOutSetMagic) << TXOUTSET_VERSION << FLATDATA(pchMessageStart) << stats.hashBlock;
+                    WriteTxOutSetData(*pfileout, hasherFile, ssFile);
                 }
+            } else if (slKey.size() == 1 + sizeof(uint256) && slKey[0] == 'c') {
+                uint256 txhash;
+                memcpy(txhash.begin(), slKey.data() + 1, sizeof(uint256));
+                CMemoryReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                HashCoinsRecord(ss, stats, txhash, ssValue, ssOuts, vchMask, txout);
                 stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                if (pfileout) {
+                    vchValue.assign(slValue.data(), slValue.data() + slValue.size());
+                    ssFile << txhash << vchValue;
+                    WriteTxOutSetData(*pfileout, hasherFile, ssFile);
+                }
+
+                // Transaction ids are random, so their first byte tells how far along we are
+                int nProgress = (unsigned char)slKey[1] * 100 / 256 / 10 * 10;
+                if (nProgress > nProgressReported) {
+                    printf("ScanTxOutSet() : %d%% of the UTXO set scanned\n", nProgress);
+                    nProgressReported = nProgress;
+                }
             }
             pcursor->Next();
         } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            fOk = error("%s() : %s", __PRETTY_FUNCTION__, e.what());
+            break;
         }
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
+    db.ReleaseSnapshot(snapshot);
+    if (!fOk)
+        return false;
+
+    {
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(stats.hashBlock);
+        if (it != mapBlockIndex.end())
+            stats.nHeight = it->second->nHeight;
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+
+    if (pfileout) {
+        if (stats.hashBlock == 0)
+            return error("%s() : no best block", __PRETTY_FUNCTION__);
+        try {
+            ssFile << uint256(0) << stats.nTransactions << stats.hashSerialized;
+            WriteTxOutSetData(*pfileout, hasherFile, ssFile);
+            *pfileout << hasherFile.GetHash();
+        } catch (std::exception &e) {
+            return error("%s() : %s", __PRETTY_FUNCTION__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    return ScanTxOutSet(stats, NULL);
+}
+
+bool CCoinsViewDB::WriteTxOutSet(CAutoFile &fileout, CCoinsStats &stats) {
+    return ScanTxOutSet(stats, boost::addressof(fileout));
+}
+
+// Read a UTXO snapshot file, checking everything WriteTxOutSet vouches for.
+// With pdb set, its coins replace those in that database as they are read.
+bool static ReadTxOutSetFile(CAutoFile &filein, CCoinsStats &stats, CLevelDB *pdb) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CDataStream ssOuts(SER_GETHASH, PROTOCOL_VERSION);
+    std::vector<unsigned char> vchMask;
+    CTxOut txout;
+    CHashWriter hasherFile(SER_DISK, CLIENT_VERSION);
+    CDataStream ssFile(SER_DISK, CLIENT_VERSION);
+    std::vector<char> vchValue;
+    CLevelDBBatch batch;
+    size_t nBatchSize = 0;
+    try {
+        unsigned char pchMagic[4], pchMessageStartFile[4];
+        int nVersion = 0;
+        filein >> FLATDATA(pchMagic) >> nVersion >> FLATDATA(pchMessageStartFile) >> stats.hashBlock;
+        if (memcmp(pchMagic, pchTxOutSetMagic, sizeof(pchMagic)) != 0 || nVersion != TXOUTSET_VERSION)
+            return error("%s() : not a UTXO snapshot of a known version", __PRETTY_FUNCTION__);
+        if (memcmp(pchMessageStartFile, pchMessageStart, sizeof(pchMessageStart)) != 0)
+            return error("%s() : UTXO snapshot of another network", __PRETTY_FUNCTION__);
+        ssFile << FLATDATA(pchMagic) << nVersion << FLATDATA(pchMessageStartFile) << stats.hashBlock;
+        hasherFile.write(&ssFile[0], ssFile.size());
+        ssFile.clear();
+        ss << stats.hashBlock;
+
+        uint256 txhashPrev = 0;
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint256 txhash;
+            filein >> txhash;
+            if (txhash == 0)
+                break;
+            // Database order, which the hash depends on and LevelDB ingests fastest
+            if (txhashPrev != 0 && memcmp(txhashPrev.begin(), txhash.begin(), sizeof(uint256)) >= 0)
+                return error("%s() : UTXO snapshot records out of order", __PRETTY_FUNCTION__);
+            txhashPrev = txhash;
+            filein >> vchValue;
+            if (vchValue.empty())
+                return error("%s() : empty UTXO snapshot record", __PRETTY_FUNCTION__);
+            ssFile << txhash << vchValue;
+            hasherFile.write(&ssFile[0], ssFile.size());
+            ssFile.clear();
+
+            CMemoryReader ssValue(&vchValue[0], &vchValue[0] + vchValue.size(), SER_DISK, CLIENT_VERSION);
+            HashCoinsRecord(ss, stats, txhash, ssValue, ssOuts, vchMask, txout);
+            if (!ssValue.eof())
+                return error("%s() : trailing data in UTXO snapshot record", __PRETTY_FUNCTION__);
+            stats.nSerializedSize += 32 + vchValue.size();
+
+            if (pdb) {
+                batch.Write(make_pair('c', txhash), CFlatData(&vchValue[0], &vchValue[0] + vchValue.size()));
+                nBatchSize += 33 + vchValue.size();
+                if (nBatchSize >= TXOUTSET_BATCH_SIZE) {
+                    if (!pdb->WriteBatch(batch))
+                        return error("%s() : database write failed", __PRETTY_FUNCTION__);
+                    batch.Clear();
+                    nBatchSize = 0;
+                }
+            }
+        }
+
+        uint64 nTransactions = 0;
+        uint256 hashSerialized, hashFile;
+        filein >> nTransactions >> hashSerialized;
+        ssFile << uint256(0) << nTransactions << hashSerialized;
+        hasherFile.write(&ssFile[0], ssFile.size());
+        filein >> hashFile;
+        if (hashFile != hasherFile.GetHash())
+            return error("%s() : UTXO snapshot checksum mismatch", __PRETTY_FUNCTION__);
+        stats.hashSerialized = ss.GetHash();
+        if (nTransactions != stats.nTransactions || hashSerialized != stats.hashSerialized)
+            return error("%s() : UTXO snapshot does not match its hash_serialized", __PRETTY_FUNCTION__);
+    } catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error: %s", __PRETTY_FUNCTION__, e.what());
+    }
+
+    if (pdb) {
+        // Last, so an interrupted import never looks complete
+        batch.Write('B', stats.hashBlock);
+        if (!pdb->WriteBatch(batch, true))
+            return error("%s() : database write failed", __PRETTY_FUNCTION__);
+    }
     return true;
 }
 
+bool CCoinsViewDB::VerifyTxOutSet(CAutoFile &filein, CCoinsStats &stats) {
+    return ReadTxOutSetFile(filein, stats, NULL);
+}
+
+bool CCoinsViewDB::LoadTxOutSet(CAutoFile &filein, CCoinsStats &stats) {
+    // Drop the best block first, so an interrupted import never passes for
+    // the old state, then the old coins
+    CLevelDBBatch batch;
+    batch.Erase('B');
+    if (!db.WriteBatch(batch, true))
+        return error("%s() : database write failed", __PRETTY_FUNCTION__);
+    batch.Clear();
+    size_t nBatchSize = 0;
+    leveldb::Iterator *pcursor = db.NewIterator();
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != 1 + sizeof(uint256) || slKey[0] != 'c')
+            continue;
+        uint256 txhash;
+        memcpy(txhash.begin(), slKey.data() + 1, sizeof(uint256));
+        batch.Erase(make_pair('c', txhash));
+        nBatchSize += slKey.size();
+        if (nBatchSize >= TXOUTSET_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                break;
+            batch.Clear();
+            nBatchSize = 0;
+        }
+    }
+    bool fOk = pcursor->status().ok();
+    delete pcursor;
+    if (!fOk || !db.WriteBatch(batch))
+        return error("%s() : database write failed", __PRETTY_FUNCTION__);
+    return ReadTxOutSetFile(filein, stats, &db);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
@@ -241,3 +475,43 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+bool CBlockTreeDB::ReadVerifiedProofOfWork(std::vector<uint256> &vHash)
+{
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('b', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    bool fOk = true;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 hash;
+            ssKey >> chType;
+            if (chType != 'b')
+                break;
+            ssKey >> hash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Only trust entries whose header still hashes to their key
+            if ((diskindex.nStatus & BLOCK_VALID_POW) && diskindex.GetBlockHash() == hash)
+                vHash.push_back(hash);
+
+            pcursor->Next();
+        } catch (std::exception &e) {
+            fOk = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            break;
+        }
+    }
+    delete pcursor;
+
+    return fOk;
+}
@@ -8,6 +8,17 @@
 #include "main.h"
 #include "leveldb.h"
 
+/** UTXO snapshot files (dumptxoutset, -loadtxoutset), all in disk serialization:
+ *  "utxo", TXOUTSET_VERSION, pchMessageStart, best block hash;
+ *  per transaction with unspent outputs, in database key order: txid and its
+ *  database record (a compressed CCoins) as a byte vector;
+ *  a null txid, the transaction count and hash_serialized as gettxoutsetinfo
+ *  reports them, and a double SHA-256 of everything before it. */
+static const unsigned char pchTxOutSetMagic[4] = { 'u', 't', 'x', 'o' };
+static const int TXOUTSET_VERSION = 1;
+/** Bytes of records per database write while importing a snapshot */
+static const size_t TXOUTSET_BATCH_SIZE = 16 << 20;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -21,8 +32,16 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    // Like GetStats, also writing the coins out as a snapshot file
+    bool WriteTxOutSet(CAutoFile &fileout, CCoinsStats &stats);
+    // Check a snapshot file through to its checksum, without importing it
+    bool VerifyTxOutSet(CAutoFile &filein, CCoinsStats &stats);
+    // Replace all coins and the best block with a snapshot file's
+    bool LoadTxOutSet(CAutoFile &filein, CCoinsStats &stats);
+protected:
+    bool ScanTxOutSet(CCoinsStats &stats, CAutoFile *pfileout);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -43,11 +62,16 @@ public:
     bool WriteLastBlockFile(int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    // Block and undo data at or past these positions may not be on disk yet
+    bool WriteSyncMarker(int nFile, unsigned int nSize, unsigned int nUndoSize);
+    bool ReadSyncMarker(int &nFile, unsigned int &nSize, unsigned int &nUndoSize);
+    bool EraseSyncMarker();
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
+    bool ReadVerifiedProofOfWork(std::vector<uint256> &vHash);
 };
 
 #endif // BITCOIN_TXDB_LEVELDB_H